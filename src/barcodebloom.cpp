@@ -0,0 +1,77 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "barcodebloom.h"
+#include "barcodetable.h"
+#include "util.h"
+#include "memfunc.h"
+#include <string.h>
+#include <iostream>
+
+BarcodeBloom::BarcodeBloom(long keys) {
+    int blockBits = 1;
+    while((0x01L << blockBits) * 512 < keys * BARCODE_BLOOM_BITS_PER_KEY)
+        blockBits++;
+    mMask = (0x01UL << blockBits) - 1;
+    // the block is chosen by the highest bits of the hash
+    mShift = 64 - blockBits;
+    size_t size = (mMask + 1) * 64;
+    mBuffer = tmalloc(size + 64);
+    if(mBuffer == NULL)
+        error_exit("Failed to allocate barcode prefilter with " + to_string(size) + " bytes");
+    mBlocks = (uint64*)(((unsigned long)mBuffer + 63) & ~63UL);
+    memset(mBlocks, 0, size);
+}
+
+BarcodeBloom::~BarcodeBloom() {
+    if(mBuffer) {
+        tfree(mBuffer);
+        mBuffer = NULL;
+    }
+}
+
+bool BarcodeBloom::test() {
+    const long keys = 100000;
+    BarcodeBloom bloom(keys);
+    for(uint64 k=0; k<keys; k++)
+        bloom.add(hashBarcodeKey(k * 2 + 1));
+    // no false negatives
+    for(uint64 k=0; k<keys; k++) {
+        if(!bloom.mayContain(hashBarcodeKey(k * 2 + 1))) {
+            cerr << "key " << k * 2 + 1 << " is added but rejected" << endl;
+            return false;
+        }
+    }
+    // a few false positives
+    long falsePositives = 0;
+    for(uint64 k=0; k<keys; k++) {
+        if(bloom.mayContain(hashBarcodeKey(k * 2 + 2)))
+            falsePositives++;
+    }
+    if(falsePositives > keys / 50) {
+        cerr << "too many false positives: " << falsePositives << " of " << keys << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// A blocked Bloom filter of the keys in a barcode table. Every key sets its bits in a single 64-byte block,
+// so a lookup touches one cache line, and most of the reads that cannot match any barcode are rejected
+// without probing the (much larger) table.
+
+#ifndef BARCODE_BLOOM_H
+#define BARCODE_BLOOM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "common.h"
+
+using namespace std;
+
+// the number of bits set by each key, each bit is addressed by 9 bits of the hash
+const int BARCODE_BLOOM_HASHES = 6;
+// the filter has about this number of bits for each key
+const int BARCODE_BLOOM_BITS_PER_KEY = 10;
+
+class BarcodeBloom {
+public:
+    BarcodeBloom(long keys);
+    ~BarcodeBloom();
+    // the hash is the hashBarcodeKey() of a key
+    inline void add(unsigned long hash) {
+        uint64* block = mBlocks + ((hash >> mShift) & mMask) * 8;
+        unsigned long bits = remix(hash);
+        for(int i=0; i<BARCODE_BLOOM_HASHES; i++) {
+            int bit = (bits >> (i * 9)) & 0x1FF;
+            block[bit >> 6] |= 0x01UL << (bit & 0x3F);
+        }
+    }
+    // false if the key is surely not added
+    inline bool mayContain(unsigned long hash) const {
+        const uint64* block = mBlocks + ((hash >> mShift) & mMask) * 8;
+        unsigned long bits = remix(hash);
+        for(int i=0; i<BARCODE_BLOOM_HASHES; i++) {
+            int bit = (bits >> (i * 9)) & 0x1FF;
+            if((block[bit >> 6] & (0x01UL << (bit & 0x3F))) == 0)
+                return false;
+        }
+        return true;
+    }
+    long bytes() {return (mMask + 1) * 64;}
+
+    static bool test();
+
+private:
+    // the block is chosen by the highest bits of the hash, the bits in the block need other well mixed bits
+    inline static unsigned long remix(unsigned long hash) {
+        return (hash ^ (hash >> 29)) * 0xC2B2AE3D27D4EB4FUL;
+    }
+
+private:
+    // the 64-byte aligned blocks of 8 words
+    uint64* mBlocks;
+    // the allocated memory, mBlocks is in it
+    void* mBuffer;
+    unsigned long mMask;
+    int mShift;
+};
+
+#endif
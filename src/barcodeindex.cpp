@@ -0,0 +1,444 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "barcodeindex.h"
+#include "util.h"
+#include "memfunc.h"
+#include <unistd.h>
+
+BarcodeIndex::BarcodeIndex(int matchMode, int mismatch){
+    mMatchMode = matchMode;
+    mMismatch = mismatch;
+    mTable = NULL;
+    mWideTable = NULL;
+    mHammingMatcher = NULL;
+    mEditMatcher = NULL;
+    mMinPosterior = 0.99;
+    mThreadNum = 1;
+}
+
+BarcodeIndex::~BarcodeIndex() {
+    if(mTable) {
+        delete mTable;
+        mTable = NULL;
+    }
+    if(mWideTable) {
+        delete mWideTable;
+        mWideTable = NULL;
+    }
+    if(mHammingMatcher) {
+        delete mHammingMatcher;
+        mHammingMatcher = NULL;
+    }
+    if(mEditMatcher) {
+        delete mEditMatcher;
+        mEditMatcher = NULL;
+    }
+}
+
+int BarcodeIndex::addBarcode(const string& barcode) {
+    map<string, int>::iterator iter = mBarcodeIds.find(barcode);
+    if(iter != mBarcodeIds.end())
+        return iter->second;
+
+    if(barcode.empty())
+        error_exit("You should specify barcode for each record");
+
+    int id = mBarcodes.size();
+    mBarcodes.push_back(barcode);
+    mBarcodeIds[barcode] = id;
+    return id;
+}
+
+void BarcodeIndex::build() {
+    if(mMatchMode == MATCH_MODE_HAMMING || mMatchMode == MATCH_MODE_QUALITY) {
+        mHammingMatcher = new HammingMatcher(mMismatch);
+        mHammingMatcher->setMinPosterior(mMinPosterior);
+        for(int i=0; i<mBarcodes.size(); i++)
+            mHammingMatcher->addBarcode(mBarcodes[i], i);
+    } else if(mMatchMode == MATCH_MODE_EDIT) {
+        mEditMatcher = new EditMatcher(mMismatch);
+        for(int i=0; i<mBarcodes.size(); i++)
+            mEditMatcher->addBarcode(mBarcodes[i], i);
+    } else {
+        buildTable();
+    }
+}
+
+void BarcodeIndex::buildTable() {
+    // count the keys to size the tables
+    long keys = 0;
+    long wideKeys = 0;
+    for(int i=0; i<mBarcodes.size(); i++) {
+        int len = mBarcodes[i].length();
+        if(len > BarcodeTable<uint128>::MAX_LEN)
+            error_exit("Barcode length should be <= " + to_string(BarcodeTable<uint128>::MAX_LEN) + "bp for table match mode, use --match_mode=hamming for longer barcodes: " + mBarcodes[i]);
+        long combinations = 1;
+        for(int d=0; d<=mMismatch && d<=len; d++) {
+            if(len <= BarcodeTable<uint64>::MAX_LEN)
+                keys += combinations;
+            else
+                wideKeys += combinations;
+            combinations = combinations * (len - d) / (d + 1) * 3;
+        }
+    }
+
+    if(keys > 0)
+        mTable = new BarcodeTable<uint64>(keys, mMismatch);
+    if(wideKeys > 0)
+        mWideTable = new BarcodeTable<uint128>(wideKeys, mMismatch);
+
+    vector<string> barcodes, wideBarcodes;
+    vector<int> ids, wideIds;
+    for(int i=0; i<mBarcodes.size(); i++) {
+        if(mBarcodes[i].length() <= BarcodeTable<uint64>::MAX_LEN) {
+            barcodes.push_back(mBarcodes[i]);
+            ids.push_back(i);
+        } else {
+            wideBarcodes.push_back(mBarcodes[i]);
+            wideIds.push_back(i);
+        }
+    }
+    if(mTable) {
+        if(!mBudgets.empty())
+            mTable->setBudgets(mBudgets);
+        mTable->addBarcodes(barcodes, ids, mThreadNum);
+        mTable->buildPrefilter();
+    }
+    if(mWideTable) {
+        if(!mBudgets.empty())
+            mWideTable->setBudgets(mBudgets);
+        mWideTable->addBarcodes(wideBarcodes, wideIds, mThreadNum);
+        mWideTable->buildPrefilter();
+    }
+}
+
+int BarcodeIndex::match(const char* data, size_t len, int& dist, const char* qual) {
+    if(qual && mMatchMode == MATCH_MODE_QUALITY) {
+        double posterior = 0;
+        return mHammingMatcher->matchWithQuality(data, qual, len, dist, posterior);
+    }
+    if(len <= BarcodeTable<uint64>::MAX_LEN) {
+        if(mTable)
+            return mTable->match(data, len, dist);
+    } else if(len <= BarcodeTable<uint128>::MAX_LEN) {
+        if(mWideTable)
+            return mWideTable->match(data, len, dist);
+    }
+    if(mHammingMatcher)
+        return mHammingMatcher->match(data, len, dist);
+    return -1;
+}
+
+int BarcodeIndex::matchInWindow(const char* window, int windowLen, int expectedStart, int& dist, int& spanStart, int& spanLen) {
+    if(mEditMatcher == NULL)
+        return -1;
+    return mEditMatcher->match(window, windowLen, expectedStart, dist, spanStart, spanLen);
+}
+
+void BarcodeIndex::autoMismatch() {
+    if(mMatchMode != MATCH_MODE_TABLE)
+        return;
+    mNearest.assign(mBarcodes.size(), HAMMING_MAX_LEN + 1);
+    mBudgets.assign(mBarcodes.size(), mMismatch);
+    // only the barcodes of a same length can have a same key
+    map<int, vector<int> > idsOfLength;
+    for(int i=0; i<mBarcodes.size(); i++)
+        idsOfLength[mBarcodes[i].length()].push_back(i);
+    map<int, vector<int> >::iterator iter;
+    for(iter = idsOfLength.begin(); iter != idsOfLength.end(); iter++) {
+        vector<int>& ids = iter->second;
+        HammingMatcher matcher(0);
+        for(int i=0; i<ids.size(); i++)
+            matcher.addBarcode(mBarcodes[ids[i]], ids[i]);
+        vector<int> nearest;
+        matcher.nearestDistances(nearest, mThreadNum);
+        for(int i=0; i<ids.size(); i++) {
+            mNearest[ids[i]] = nearest[i];
+            mBudgets[ids[i]] = min(mMismatch, (nearest[i] - 1) / 2);
+        }
+    }
+}
+
+uint64 BarcodeIndex::signature() {
+    // FNV-1a
+    uint64 sig = 14695981039346656037UL;
+    string text = to_string(mMatchMode) + ":" + to_string(mMismatch);
+    if(!mBudgets.empty())
+        text += ":auto";
+    for(int i=0; i<mBarcodes.size(); i++)
+        text += "," + mBarcodes[i];
+    for(int i=0; i<text.length(); i++) {
+        sig ^= (unsigned char)text[i];
+        sig *= 1099511628211UL;
+    }
+    return sig;
+}
+
+inline static uint64 alignTo64(uint64 offset) {
+    return (offset + 63) & ~((uint64)63);
+}
+
+void BarcodeIndex::saveTables(const string& filename, uint64 signature, vector<BarcodeIndex*>& indexes) {
+    vector<BarcodeTableFileSection> sections;
+    vector<const char*> tables;
+    vector<uint64> tableLens;
+    for(int i=0; i<indexes.size(); i++) {
+        for(int wide=0; wide<2; wide++) {
+            BarcodeTableFileSection section;
+            memset(&section, 0, sizeof(BarcodeTableFileSection));
+            section.index = i;
+            section.wide = wide;
+            section.mismatch = indexes[i]->mMismatch;
+            if(wide == 0 && indexes[i]->mTable) {
+                section.bits = indexes[i]->mTable->bits();
+                tables.push_back((const char*)indexes[i]->mTable->entries());
+                tableLens.push_back(indexes[i]->mTable->size() * sizeof(BarcodeTableEntry<uint64>));
+            } else if(wide == 1 && indexes[i]->mWideTable) {
+                section.bits = indexes[i]->mWideTable->bits();
+                tables.push_back((const char*)indexes[i]->mWideTable->entries());
+                tableLens.push_back(indexes[i]->mWideTable->size() * sizeof(BarcodeTableEntry<uint128>));
+            } else {
+                continue;
+            }
+            sections.push_back(section);
+        }
+    }
+
+    BarcodeTableFileHeader header;
+    memset(&header, 0, sizeof(BarcodeTableFileHeader));
+    memcpy(header.magic, BARCODE_TABLE_FILE_MAGIC, 8);
+    header.version = BARCODE_TABLE_FILE_VERSION;
+    header.sectionNum = sections.size();
+    header.signature = signature;
+    uint64 offset = alignTo64(sizeof(BarcodeTableFileHeader) + sections.size() * sizeof(BarcodeTableFileSection));
+    for(int t=0; t<sections.size(); t++) {
+        sections[t].offset = offset;
+        offset = alignTo64(offset + tableLens[t]);
+    }
+    header.fileLen = offset;
+
+    char* data = (char*)tmalloc(header.fileLen);
+    if(data == NULL)
+        error_exit("Failed to allocate " + to_string(header.fileLen) + " bytes for the prebuilt index");
+    memset(data, 0, header.fileLen);
+    memcpy(data, &header, sizeof(BarcodeTableFileHeader));
+    if(sections.size() > 0)
+        memcpy(data + sizeof(BarcodeTableFileHeader), &sections[0], sections.size() * sizeof(BarcodeTableFileSection));
+    for(int t=0; t<sections.size(); t++)
+        memcpy(data + sections[t].offset, tables[t], tableLens[t]);
+    MappedFile::writeAtomically(filename, data, header.fileLen);
+    tfree(data);
+}
+
+bool BarcodeIndex::loadTables(MappedFile* file, uint64 signature, vector<BarcodeIndex*>& indexes) {
+    const char* data = file->data();
+    if(data == NULL || file->size() < sizeof(BarcodeTableFileHeader))
+        return false;
+    const BarcodeTableFileHeader* header = (const BarcodeTableFileHeader*)data;
+    if(memcmp(header->magic, BARCODE_TABLE_FILE_MAGIC, 8) != 0 || header->version != BARCODE_TABLE_FILE_VERSION
+        || header->signature != signature || header->fileLen != file->size()
+        || sizeof(BarcodeTableFileHeader) + header->sectionNum * sizeof(BarcodeTableFileSection) > file->size())
+        return false;
+
+    const BarcodeTableFileSection* sections = (const BarcodeTableFileSection*)(data + sizeof(BarcodeTableFileHeader));
+    // check all the sections before using any of them
+    for(int t=0; t<header->sectionNum; t++) {
+        const BarcodeTableFileSection& section = sections[t];
+        uint64 entrySize = section.wide ? sizeof(BarcodeTableEntry<uint128>) : sizeof(BarcodeTableEntry<uint64>);
+        if(section.index >= indexes.size() || section.bits >= 48 || section.offset % 64 != 0
+            || section.offset + (0x01UL << section.bits) * entrySize > file->size())
+            return false;
+        BarcodeIndex* index = indexes[section.index];
+        if(index->mMatchMode != MATCH_MODE_TABLE || section.mismatch != index->mMismatch)
+            return false;
+    }
+    for(int t=0; t<header->sectionNum; t++) {
+        const BarcodeTableFileSection& section = sections[t];
+        BarcodeIndex* index = indexes[section.index];
+        if(section.wide) {
+            index->mWideTable = new BarcodeTable<uint128>((const BarcodeTableEntry<uint128>*)(data + section.offset), section.bits, section.mismatch);
+            if(!index->mBudgets.empty())
+                index->mWideTable->setBudgets(index->mBudgets);
+            index->mWideTable->buildPrefilter();
+        } else {
+            index->mTable = new BarcodeTable<uint64>((const BarcodeTableEntry<uint64>*)(data + section.offset), section.bits, section.mismatch);
+            if(!index->mBudgets.empty())
+                index->mTable->setBudgets(index->mBudgets);
+            index->mTable->buildPrefilter();
+        }
+    }
+    return true;
+}
+
+long BarcodeIndex::kmer2key(const char* data, size_t len) {
+    uint64 key = 0;
+    if(len > BarcodeTable<uint64>::MAX_LEN || !BarcodeTable<uint64>::encode(data, len, key))
+        return -1;
+    return key;
+}
+
+bool BarcodeIndex::test() {
+    BarcodeIndex index(MATCH_MODE_TABLE, 2);
+    int id1 = index.addBarcode("AGTCAGAA");
+    int id2 = index.addBarcode("CCGTTACG");
+    int id3 = index.addBarcode("AGTCAGTT");
+    if(index.addBarcode("CCGTTACG") != id2 || index.size() != 3)
+        return false;
+    index.build();
+
+    int dist = -1;
+    if(index.match("CCGTTACG", 8, dist) != id2 || dist != 0)
+        return false;
+    if(index.match("CCGTAACG", 8, dist) != id2 || dist != 1)
+        return false;
+    if(index.match("CAGTAACG", 8, dist) != id2 || dist != 2)
+        return false;
+    if(index.match("CAGTAACC", 8, dist) != -1)
+        return false;
+    // the exact barcode wins over the 2-mismatch mutant of another barcode
+    if(index.match("AGTCAGAA", 8, dist) != id1 || dist != 0)
+        return false;
+    // AGTCAGAT is 1 mismatch to both AGTCAGAA and AGTCAGTT
+    if(index.match("AGTCAGAT", 8, dist) != -1)
+        return false;
+    // N is counted as a mismatch
+    if(index.match("CCGTNACG", 8, dist) != id2 || dist != 1)
+        return false;
+    if(index.match("CNGTAACG", 8, dist) != id2 || dist != 2)
+        return false;
+    if(index.match("CNGTNACG", 8, dist) != id2 || dist != 2)
+        return false;
+    if(index.match("CNGTNACC", 8, dist) != -1)
+        return false;
+    if(index.match("NNNTTACG", 8, dist) != -1)
+        return false;
+    // AGTCAGNN is 2 mismatches to both AGTCAGAA and AGTCAGTT
+    if(index.match("AGTCAGNN", 8, dist) != -1)
+        return false;
+    // AGTCAGNA is 1 mismatch to AGTCAGAA and 2 mismatches to AGTCAGTT
+    if(index.match("AGTCAGNA", 8, dist) != id1 || dist != 1)
+        return false;
+    // different lengths never share a key
+    if(index.match("AGTCAGA", 7, dist) != -1)
+        return false;
+    if(index.match("AGTCAGTTA", 9, dist) != -1)
+        return false;
+
+    // 24+24bp dual index as a whole
+    BarcodeIndex wide(MATCH_MODE_TABLE, 2);
+    string w1("AGTCAGAATTCGGATCCAAGTCAGCCGTTACGTTCGGATCCAAGTCAG");
+    string w2("AGTCAGAATTCGGATCCAAGTCAGAGTCAGTTTTCGGATCCAAGTCAG");
+    int wid1 = wide.addBarcode(w1);
+    int wid2 = wide.addBarcode(w2);
+    wide.addBarcode("CCGTTACG");
+    wide.build();
+    string r = w2;
+    r[40] = 'A';
+    r[3] = 'G';
+    if(wide.match(r.c_str(), r.length(), dist) != wid2 || dist != 2)
+        return false;
+    if(wide.match(w1.c_str(), w1.length(), dist) != wid1 || dist != 0)
+        return false;
+    if(wide.match("CCGTTACC", 8, dist) != 2 || dist != 1)
+        return false;
+
+    // the tables loaded from a prebuilt file give the same results
+    string filename = "/tmp/defastq_test_" + to_string(getpid()) + ".idx";
+    vector<BarcodeIndex*> indexes;
+    indexes.push_back(&wide);
+    BarcodeIndex::saveTables(filename, wide.signature(), indexes);
+    BarcodeIndex loaded(MATCH_MODE_TABLE, 2);
+    loaded.addBarcode(w1);
+    loaded.addBarcode(w2);
+    loaded.addBarcode("CCGTTACG");
+    MappedFile file;
+    bool opened = file.open(filename);
+    remove(filename.c_str());
+    indexes[0] = &loaded;
+    if(!opened || loaded.signature() != wide.signature() || !BarcodeIndex::loadTables(&file, loaded.signature(), indexes))
+        return false;
+    if(loaded.match(r.c_str(), r.length(), dist) != wid2 || dist != 2)
+        return false;
+    if(loaded.match("CCGTTACC", 8, dist) != 2 || dist != 1)
+        return false;
+    if(BarcodeIndex::loadTables(&file, loaded.signature() + 1, indexes))
+        return false;
+
+    BarcodeIndex hamming(MATCH_MODE_HAMMING, 3);
+    hamming.addBarcode("AGTCAGAA");
+    hamming.addBarcode("CCGTTACG");
+    hamming.build();
+    if(hamming.match("CAGTAACC", 8, dist) != 1 || dist != 3)
+        return false;
+
+    // the table built by threads has same keys and values as the one built serially
+    BarcodeIndex serial(MATCH_MODE_TABLE, 2);
+    BarcodeIndex parallel(MATCH_MODE_TABLE, 2);
+    parallel.setThreadNum(4);
+    srand(7);
+    for(int i=0; i<200; i++) {
+        string barcode(10, 'A');
+        for(int b=0; b<10; b++)
+            barcode[b] = "ATCG"[rand() & 0x03];
+        serial.addBarcode(barcode);
+        parallel.addBarcode(barcode);
+    }
+    serial.build();
+    parallel.build();
+    if(serial.mTable->size() < 0x01L << 16 || serial.mTable->size() != parallel.mTable->size())
+        return false;
+    const BarcodeTableEntry<uint64>* entries = serial.mTable->entries();
+    const BarcodeTableEntry<uint64>* parallelEntries = parallel.mTable->entries();
+    long serialKeys = 0;
+    long parallelKeys = 0;
+    for(long i=0; i<serial.mTable->size(); i++) {
+        if(entries[i].key != 0) {
+            serialKeys++;
+            if(parallel.mTable->lookup(entries[i].key) != entries[i].value)
+                return false;
+        }
+        if(parallelEntries[i].key != 0)
+            parallelKeys++;
+    }
+    if(serialKeys != parallelKeys)
+        return false;
+
+    // auto mismatch: AGTCAGAA and AGTCAGTT are 2 apart so they get 0, CCGTTACG is far from both and gets 2
+    BarcodeIndex autoIndex(MATCH_MODE_TABLE, 2);
+    autoIndex.addBarcode("AGTCAGAA");
+    autoIndex.addBarcode("AGTCAGTT");
+    autoIndex.addBarcode("CCGTTACG");
+    autoIndex.autoMismatch();
+    autoIndex.build();
+    if(autoIndex.nearestDistance(0) != 2 || autoIndex.mismatchOf(0) != 0 || autoIndex.mismatchOf(2) != 2)
+        return false;
+    if(autoIndex.match("AGTCAGAT", 8, dist) != -1 || autoIndex.match("CCGTAAAG", 8, dist) != 2 || dist != 2)
+        return false;
+    // an N counts to the budget of the matched barcode
+    if(autoIndex.match("AGTCAGAN", 8, dist) != -1 || autoIndex.match("CCGTNACG", 8, dist) != 2)
+        return false;
+
+    return id3 == 2;
+}
@@ -0,0 +1,128 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef BARCODE_INDEX_H
+#define BARCODE_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "common.h"
+#include "hammingmatcher.h"
+#include "editmatcher.h"
+#include "barcodetable.h"
+#include "mappedfile.h"
+
+using namespace std;
+
+const char BARCODE_TABLE_FILE_MAGIC[8] = {'D', 'F', 'Q', 'T', 'B', 'L', 'I', 'X'};
+const uint32 BARCODE_TABLE_FILE_VERSION = 1;
+
+// a prebuilt table file begins with this header, followed by a section for each table
+struct BarcodeTableFileHeader {
+    char magic[8];
+    uint32 version;
+    uint32 sectionNum;
+    uint64 signature;
+    uint64 fileLen;
+};
+
+struct BarcodeTableFileSection {
+    // which BarcodeIndex the table belongs to
+    uint32 index;
+    // 1 for the table of uint128 keys
+    uint32 wide;
+    uint32 bits;
+    uint32 mismatch;
+    // the offset of the entries in bytes from the file beginning
+    uint64 offset;
+};
+
+// The lookup structure for one barcode slot (i.e. index1, index2 or the inline barcode).
+// Every distinct barcode gets an id, match() returns the id of the matched barcode.
+// In table mode, all the keys within the mismatch budget are precomputed into an open addressing table,
+// a key reachable from several barcodes belongs to the nearest one, or is ambiguous if there is a tie.
+// Barcodes <= 31bp use 64-bit keys, longer barcodes (<= 63bp) use 128-bit keys in a separate table.
+class BarcodeIndex{
+public:
+    BarcodeIndex(int matchMode, int mismatch);
+    ~BarcodeIndex();
+    // add a barcode, a same barcode always gets a same id
+    int addBarcode(const string& barcode);
+    // build the lookup structure after all barcodes are added
+    void build();
+    // return the id of the matched barcode or -1, the distance is stored in dist
+    // the qualities of the bases are only used in quality match mode
+    int match(const char* data, size_t len, int& dist, const char* qual = NULL);
+    // edit match mode only, search a window of a read for a barcode with insertions/deletions
+    // the matched span of the window is stored in spanStart and spanLen
+    int matchInWindow(const char* window, int windowLen, int expectedStart, int& dist, int& spanStart, int& spanLen);
+    // the min posterior probability for quality match mode
+    void setMinPosterior(double p) {mMinPosterior = p;}
+    // the number of threads to build the table
+    void setThreadNum(int n) {mThreadNum = n;}
+    int size() {return mBarcodes.size();}
+    string barcode(int id) {return mBarcodes[id];}
+    // a hash of the match mode, mismatch and all the barcodes
+    uint64 signature();
+    // table mode only, give each barcode the largest mismatch that keeps its mutants apart from the other barcodes:
+    // (nearest distance - 1) / 2, and at most the mismatch of this index. It should be called before build()
+    void autoMismatch();
+    // the mismatch budget of a barcode
+    int mismatchOf(int id) {return mBudgets.empty() ? mMismatch : mBudgets[id];}
+    // the Hamming distance from a barcode to its nearest barcode of a same length, only after autoMismatch()
+    int nearestDistance(int id) {return mNearest[id];}
+
+    // save the tables of the indexes to a file which can be loaded by loadTables() with a same signature
+    static void saveTables(const string& filename, uint64 signature, vector<BarcodeIndex*>& indexes);
+    // use the tables in a mapped file instead of build(), false if it is not valid for these indexes
+    // the file should be kept mapped while the indexes are used
+    static bool loadTables(MappedFile* file, uint64 signature, vector<BarcodeIndex*>& indexes);
+
+    // 2-bit encoded key with a leading 1 bit to distinguish the lengths, -1 if not A/T/C/G
+    static long kmer2key(const char* data, size_t len);
+    static bool test();
+
+private:
+    void buildTable();
+
+private:
+    int mMatchMode;
+    int mMismatch;
+    vector<string> mBarcodes;
+    map<string, int> mBarcodeIds;
+    // the mismatch budget of each barcode, empty means mMismatch for all
+    vector<int> mBudgets;
+    vector<int> mNearest;
+    BarcodeTable<uint64>* mTable;
+    BarcodeTable<uint128>* mWideTable;
+    HammingMatcher* mHammingMatcher;
+    EditMatcher* mEditMatcher;
+    double mMinPosterior;
+    int mThreadNum;
+};
+
+#endif
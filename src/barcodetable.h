@@ -0,0 +1,349 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// An open addressing table of all the keys within the mismatch budget of the barcodes
+// KEY is uint64 for barcodes <= 31bp (the fast path), or uint128 for barcodes <= 63bp
+
+#ifndef BARCODE_TABLE_H
+#define BARCODE_TABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include "common.h"
+#include "util.h"
+#include "memfunc.h"
+#include "barcodebloom.h"
+
+using namespace std;
+
+typedef unsigned __int128 uint128;
+
+// the id of a key that has a same distance to different barcodes
+const int BARCODE_ID_AMBIGUOUS = 0x0FFFFFFF;
+// the lowest bits of a table value store the distance
+const int BARCODE_DIST_BITS = 3;
+// at most this number of N bases can be counted as mismatches in table lookup
+const int BARCODE_TABLE_MAX_N = 4;
+// a smaller table stays in the cache, and a miss is cheap enough without a prefilter
+const long BARCODE_PREFILTER_MIN_BYTES = 0x01L << 20;
+
+inline unsigned long hashBarcodeKey(uint64 key) {
+    return key * 0x9E3779B97F4A7C15UL;
+}
+
+inline unsigned long hashBarcodeKey(uint128 key) {
+    return ((uint64)key ^ ((uint64)(key >> 64) * 0xC2B2AE3D27D4EB4FUL)) * 0x9E3779B97F4A7C15UL;
+}
+
+template<typename KEY>
+struct BarcodeTableEntry {
+    KEY key;
+    int value;
+};
+
+// a key whose probing runs out of the region of a building thread, it is added after all the threads finish
+template<typename KEY>
+struct BarcodeTableSpill {
+    KEY key;
+    int id;
+    int dist;
+};
+
+// the slots [begin, end) filled by one building thread
+template<typename KEY>
+struct BarcodeTableRegion {
+    unsigned long begin;
+    unsigned long end;
+    vector<BarcodeTableSpill<KEY> > spills;
+};
+
+template<typename KEY>
+class BarcodeTable {
+public:
+    // a key holds 2 bits for each base, and a leading 1 bit to distinguish the lengths
+    static const int MAX_LEN = (sizeof(KEY) * 8 - 2) / 2;
+
+    inline BarcodeTable(long keys, int mismatch) {
+        mMismatch = mismatch;
+        // at most half full
+        mBits = 10;
+        while((0x01L << mBits) < keys * 2)
+            mBits++;
+        mLen = 0x01L << mBits;
+        mEntries = (BarcodeTableEntry<KEY>*)tmalloc(mLen * sizeof(BarcodeTableEntry<KEY>));
+        if(mEntries == NULL)
+            error_exit("Failed to allocate barcode table with " + to_string(mLen) + " entries");
+        // key 0 means empty since every key has the leading 1 bit
+        memset(mEntries, 0, mLen * sizeof(BarcodeTableEntry<KEY>));
+        mOwned = true;
+        mPrefilter = NULL;
+    }
+    // use the entries of a prebuilt table, which are not copied or freed
+    inline BarcodeTable(const BarcodeTableEntry<KEY>* entries, int bits, int mismatch) {
+        mMismatch = mismatch;
+        mBits = bits;
+        mLen = 0x01L << mBits;
+        mEntries = (BarcodeTableEntry<KEY>*)entries;
+        mOwned = false;
+        mPrefilter = NULL;
+    }
+    inline ~BarcodeTable() {
+        if(mPrefilter) {
+            delete mPrefilter;
+            mPrefilter = NULL;
+        }
+        if(mEntries && mOwned) {
+            tfree(mEntries);
+            mEntries = NULL;
+        }
+    }
+    inline void addBarcode(const string& barcode, int id) {
+        KEY key;
+        if(!encode(barcode.c_str(), barcode.length(), key))
+            error_exit("Barcode can only contain A/T/C/G: " + barcode);
+        addMutants(key, barcode.length(), id, 0, 0, NULL);
+    }
+    // Add the barcodes with a number of threads. Each thread enumerates the mutants of all the barcodes, but only
+    // fills the keys whose home slots are in its own region of the table, so the threads never write a same slot.
+    // Since a key always goes to the nearest barcode or becomes ambiguous regardless of the adding order, and each
+    // region is filled in the order of the barcodes, the lookup results are same as adding the barcodes one by one.
+    inline void addBarcodes(const vector<string>& barcodes, const vector<int>& ids, int threadNum) {
+        vector<KEY> keys(barcodes.size());
+        for(int i=0; i<barcodes.size(); i++) {
+            if(!encode(barcodes[i].c_str(), barcodes[i].length(), keys[i]))
+                error_exit("Barcode can only contain A/T/C/G: " + barcodes[i]);
+        }
+        if(threadNum <= 1 || mLen < 0x01L << 16) {
+            for(int i=0; i<barcodes.size(); i++)
+                addMutants(keys[i], barcodes[i].length(), ids[i], 0, 0, NULL);
+            return;
+        }
+
+        vector<BarcodeTableRegion<KEY> > regions(threadNum);
+        vector<thread> threads;
+        for(int t=0; t<threadNum; t++) {
+            regions[t].begin = mLen / threadNum * t;
+            regions[t].end = t == threadNum - 1 ? mLen : mLen / threadNum * (t + 1);
+            threads.push_back(thread(&BarcodeTable<KEY>::addRegion, this, &keys, &barcodes, &ids, &regions[t]));
+        }
+        for(int t=0; t<threadNum; t++)
+            threads[t].join();
+
+        // a spilled key is never in the table, so its probing continues in the next regions
+        for(int t=0; t<threadNum; t++) {
+            for(int s=0; s<regions[t].spills.size(); s++) {
+                const BarcodeTableSpill<KEY>& spill = regions[t].spills[s];
+                addKey(spill.key, spill.id, spill.dist, NULL);
+            }
+        }
+    }
+    // the mismatch budget of each barcode id, instead of the mismatch of the table for all
+    // a budget should be <= the mismatch of the table, and set before the barcodes are added
+    inline void setBudgets(const vector<int>& budgets) {
+        mBudgets.assign(budgets.begin(), budgets.end());
+    }
+    // build the prefilter of a large table after all the barcodes are added, the table cannot be changed then
+    inline void buildPrefilter() {
+        if(mPrefilter || mLen * sizeof(BarcodeTableEntry<KEY>) < BARCODE_PREFILTER_MIN_BYTES)
+            return;
+        long keys = 0;
+        for(unsigned long i=0; i<mLen; i++) {
+            if(mEntries[i].key != 0)
+                keys++;
+        }
+        mPrefilter = new BarcodeBloom(keys);
+        for(unsigned long i=0; i<mLen; i++) {
+            if(mEntries[i].key != 0)
+                mPrefilter->add(hashBarcodeKey(mEntries[i].key));
+        }
+    }
+    // return the table value, or -1 if not found
+    inline int lookup(KEY key) {
+        unsigned long hash = hashBarcodeKey(key);
+        if(mPrefilter && !mPrefilter->mayContain(hash))
+            return -1;
+        unsigned long pos = hash >> (64 - mBits);
+        while(true) {
+            const BarcodeTableEntry<KEY>& entry = mEntries[pos];
+            if(entry.key == key)
+                return entry.value;
+            if(entry.key == 0)
+                return -1;
+            pos = (pos + 1) & (mLen - 1);
+        }
+    }
+    inline int match(const char* data, size_t len, int& dist) {
+        KEY key = 1;
+        int nPos[BARCODE_TABLE_MAX_N];
+        int nCount = 0;
+        for(int k=0; k<len; k++) {
+            KEY val = 0;
+            switch(data[k]){
+                case 'A': val = 0; break;
+                case 'T': val = 1; break;
+                case 'C': val = 2; break;
+                case 'G': val = 3; break;
+                default:
+                    // a base other than A/T/C/G is a mismatch
+                    if(nCount >= mMismatch || nCount >= BARCODE_TABLE_MAX_N)
+                        return -1;
+                    nPos[nCount] = len - 1 - k;
+                    nCount++;
+            }
+            key = (key<<2) | val;
+        }
+
+        int value = -1;
+        if(nCount == 0) {
+            value = lookup(key);
+            if(value < 0)
+                return -1;
+        } else {
+            value = lookupWithN(key, nPos, nCount);
+            if(value < 0 || (value & ((1<<BARCODE_DIST_BITS) - 1)) + nCount > mMismatch)
+                return -1;
+        }
+        int id = value >> BARCODE_DIST_BITS;
+        if(id == BARCODE_ID_AMBIGUOUS)
+            return -1;
+        if(nCount > 0 && (value & ((1<<BARCODE_DIST_BITS) - 1)) + nCount > budgetOf(id))
+            return -1;
+        dist = (value & ((1<<BARCODE_DIST_BITS) - 1)) + nCount;
+        return id;
+    }
+    inline static bool encode(const char* data, size_t len, KEY& key) {
+        key = 1;
+        for(int k=0; k<len; k++) {
+            KEY val = 0;
+            switch(data[k]){
+                case 'A': val = 0; break;
+                case 'T': val = 1; break;
+                case 'C': val = 2; break;
+                case 'G': val = 3; break;
+                default:
+                    return false;
+            }
+            key = (key<<2) | val;
+        }
+        return true;
+    }
+    inline long size() {
+        return mLen;
+    }
+    inline int bits() {
+        return mBits;
+    }
+    inline const BarcodeTableEntry<KEY>* entries() {
+        return mEntries;
+    }
+
+private:
+    // try all the bases at the N positions, the nearest barcode of all these keys is the nearest barcode
+    // ignoring the N positions. Since its mutant with the same bases at the N positions is in the table,
+    // and any other barcode found at a same distance is a real tie.
+    inline int lookupWithN(KEY key, const int* nPos, int nCount) {
+        int best = -1;
+        int bestDist = 0;
+        int combinations = 1 << (nCount << 1);
+        for(int c=0; c<combinations; c++) {
+            KEY mutant = key;
+            for(int n=0; n<nCount; n++)
+                mutant |= (KEY)((c >> (n<<1)) & 0x03) << (nPos[n]<<1);
+            int value = lookup(mutant);
+            if(value < 0)
+                continue;
+            int dist = value & ((1<<BARCODE_DIST_BITS) - 1);
+            if(best < 0 || dist < bestDist) {
+                best = value;
+                bestDist = dist;
+            } else if(dist == bestDist && value != best) {
+                best = (BARCODE_ID_AMBIGUOUS << BARCODE_DIST_BITS) | dist;
+            }
+        }
+        return best;
+    }
+    inline int budgetOf(int id) {
+        return mBudgets.empty() ? mMismatch : mBudgets[id];
+    }
+    void addRegion(const vector<KEY>* keys, const vector<string>* barcodes, const vector<int>* ids, BarcodeTableRegion<KEY>* region) {
+        for(int i=0; i<keys->size(); i++)
+            addMutants((*keys)[i], (*barcodes)[i].length(), (*ids)[i], 0, 0, region);
+    }
+    // enumerate the keys with at most budgetOf(id) substitutions, each key is visited only once
+    inline void addMutants(KEY key, int len, int id, int from, int dist, BarcodeTableRegion<KEY>* region) {
+        addKey(key, id, dist, region);
+        if(dist >= budgetOf(id))
+            return;
+        for(int p=from; p<len; p++) {
+            // A/T/C/G are 0/1/2/3, XOR with 1/2/3 gives the other three bases
+            for(int delta=1; delta<=3; delta++)
+                addMutants(key ^ ((KEY)delta << (p<<1)), len, id, p+1, dist+1, region);
+        }
+    }
+    // add a key to the whole table if region is NULL, otherwise only if its home slot is in the region
+    inline void addKey(KEY key, int id, int dist, BarcodeTableRegion<KEY>* region) {
+        unsigned long pos = hashBarcodeKey(key) >> (64 - mBits);
+        if(region && (pos < region->begin || pos >= region->end))
+            return;
+        while(true) {
+            BarcodeTableEntry<KEY>& entry = mEntries[pos];
+            if(entry.key == 0) {
+                entry.key = key;
+                entry.value = (id << BARCODE_DIST_BITS) | dist;
+                return;
+            }
+            if(entry.key == key) {
+                int oldId = entry.value >> BARCODE_DIST_BITS;
+                int oldDist = entry.value & ((1<<BARCODE_DIST_BITS) - 1);
+                if(dist < oldDist)
+                    entry.value = (id << BARCODE_DIST_BITS) | dist;
+                else if(dist == oldDist && oldId != id)
+                    entry.value = (BARCODE_ID_AMBIGUOUS << BARCODE_DIST_BITS) | dist;
+                return;
+            }
+            pos = (pos + 1) & (mLen - 1);
+            if(region && (pos == region->end || pos == 0)) {
+                BarcodeTableSpill<KEY> spill = {key, id, dist};
+                region->spills.push_back(spill);
+                return;
+            }
+        }
+    }
+
+private:
+    int mMismatch;
+    BarcodeTableEntry<KEY>* mEntries;
+    unsigned long mLen;
+    int mBits;
+    bool mOwned;
+    // the mismatch budget of each barcode id, empty means mMismatch for all
+    vector<unsigned char> mBudgets;
+    // rejects most of the keys not in a large table, NULL for a small table
+    BarcodeBloom* mPrefilter;
+};
+
+#endif
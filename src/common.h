@@ -47,5 +47,16 @@ const int BARCODE_AT_READ2 = 2;
 const int BARCODE_AT_INDEX1 = 3;
 const int BARCODE_AT_INDEX2 = 4;
 const int BARCODE_AT_BOTH_INDEX = 5;
+// detect the place by Evaluator::detectBarcodePlace()
+const int BARCODE_AT_AUTO = 6;
+
+// the max length of a UMI, including the _ between the segments
+const int UMI_MAX_LEN = 64;
+
+const int MATCH_MODE_TABLE = 0;
+const int MATCH_MODE_HAMMING = 1;
+const int MATCH_MODE_QUALITY = 2;
+const int MATCH_MODE_WHITELIST = 3;
+const int MATCH_MODE_EDIT = 4;
 
 #endif /* COMMON_H */
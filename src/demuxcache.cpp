@@ -0,0 +1,60 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "demuxcache.h"
+#include "util.h"
+#include "memfunc.h"
+#include <iostream>
+
+DemuxCache::DemuxCache() {
+    mEntries = (DemuxCacheEntry*)tmalloc(DEMUX_CACHE_SIZE * sizeof(DemuxCacheEntry));
+    if(mEntries == NULL)
+        error_exit("Failed to allocate the barcode cache");
+    memset(mEntries, 0, DEMUX_CACHE_SIZE * sizeof(DemuxCacheEntry));
+    mHits = 0;
+    mMisses = 0;
+}
+
+DemuxCache::~DemuxCache() {
+    if(mEntries) {
+        tfree(mEntries);
+        mEntries = NULL;
+    }
+}
+
+bool DemuxCache::test() {
+    DemuxCache cache;
+    int owner1 = 0;
+    int owner2 = 0;
+    if(cache.find(&owner1, "ACGTACGT", 8) != NULL)
+        return false;
+    cache.store(&owner1, "ACGTACGT", 8, 3, 5, 8);
+    DemuxCacheEntry* entry = cache.find(&owner1, "ACGTACGT", 8);
+    if(entry == NULL || entry->output != 3 || entry->spanStart != 5 || entry->spanLen != 8)
+        return false;
+    // a different owner, a different length or a different base is not a hit
+    if(cache.find(&owner2, "ACGTACGT", 8) || cache.find(&owner1, "ACGTACG", 7) || cache.find(&owner1, "ACGTACGA", 8))
+        return false;
+    return cache.hits() == 1 && cache.misses() == 4;
+}
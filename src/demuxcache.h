@@ -0,0 +1,105 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// A small direct-mapped cache of the raw barcode bytes of recent reads and their demux results.
+// The raw barcodes are very skewed, most reads repeat a few hundred strings, so an expensive match
+// (i.e. edit distance, Hamming distance to many barcodes, or a huge whitelist) is mostly skipped.
+// Each demuxer thread has its own cache, so it needs no lock.
+
+#ifndef DEMUX_CACHE_H
+#define DEMUX_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+using namespace std;
+
+// the keys longer than this are not cached
+const int DEMUX_CACHE_MAX_KEY = 64;
+// the number of entries, a power of 2
+const int DEMUX_CACHE_SIZE = 1024;
+
+struct DemuxCacheEntry {
+    // the demuxer of the result, since the lanes have different demuxers
+    const void* owner;
+    long output;
+    // the matched span of an inline barcode
+    short spanStart;
+    short spanLen;
+    int keyLen;
+    char key[DEMUX_CACHE_MAX_KEY];
+};
+
+class DemuxCache {
+public:
+    DemuxCache();
+    ~DemuxCache();
+    // the entry of this key, NULL if it is not cached
+    inline DemuxCacheEntry* find(const void* owner, const char* key, int keyLen) {
+        DemuxCacheEntry* entry = mEntries + slot(key, keyLen);
+        if(entry->owner == owner && entry->keyLen == keyLen && memcmp(entry->key, key, keyLen) == 0) {
+            mHits++;
+            return entry;
+        }
+        mMisses++;
+        return NULL;
+    }
+    // replace the entry in the slot of this key
+    inline void store(const void* owner, const char* key, int keyLen, long output, int spanStart, int spanLen) {
+        DemuxCacheEntry* entry = mEntries + slot(key, keyLen);
+        entry->owner = owner;
+        entry->output = output;
+        entry->spanStart = spanStart;
+        entry->spanLen = spanLen;
+        entry->keyLen = keyLen;
+        memcpy(entry->key, key, keyLen);
+    }
+    long hits() {return mHits;}
+    long misses() {return mMisses;}
+
+    static bool test();
+
+private:
+    inline static unsigned int slot(const char* key, int keyLen) {
+        uint64 h = keyLen;
+        int i = 0;
+        for(; i + 8 <= keyLen; i += 8) {
+            uint64 word;
+            memcpy(&word, key + i, 8);
+            h = (h ^ word) * 0x9E3779B97F4A7C15UL;
+        }
+        for(; i < keyLen; i++)
+            h = (h ^ (unsigned char)key[i]) * 0x9E3779B97F4A7C15UL;
+        return (h >> 32) & (DEMUX_CACHE_SIZE - 1);
+    }
+
+private:
+    DemuxCacheEntry* mEntries;
+    long mHits;
+    long mMisses;
+};
+
+#endif
@@ -25,209 +25,783 @@ SOFTWARE.
 #include "demuxer.h"
 #include "util.h"
 #include "memfunc.h"
+#include <thread>
+#include <map>
+#include <fstream>
+#include <algorithm>
+#include <climits>
 
-Demuxer::Demuxer(Options* opt){
+Demuxer::Demuxer(Options* opt, int lane){
     mOptions = opt;
-    // M table
-    mHashTableLen = 1<<26;
-    mHashTable = (int*)tmalloc(mHashTableLen*sizeof(int));
-    memset(mHashTable, -1, mHashTableLen*sizeof(int));
+    mLane = lane;
+    mOtherLanes = NULL;
+    mIndex1 = NULL;
+    mIndex2 = NULL;
+    mWhitelist = NULL;
+    mPrebuilt = NULL;
+    mDualIndex = false;
+    mCacheKeyIndex = false;
+    mCacheKeyStart = 0;
+    mCacheKeyEnd = 0;
+    mSingleEndKernel = NULL;
+    mPairedEndKernel = NULL;
     init();
+    if(mOptions)
+        selectKernels();
 }
 
 Demuxer::~Demuxer() {
-    if(mHashTable) {
-        tfree(mHashTable);
-        mHashTable = NULL;
+    if(mIndex1) {
+        delete mIndex1;
+        mIndex1 = NULL;
+    }
+    if(mIndex2) {
+        delete mIndex2;
+        mIndex2 = NULL;
+    }
+    if(mWhitelist) {
+        delete mWhitelist;
+        mWhitelist = NULL;
+    }
+    for(int g=0; g<mInlineGroups.size(); g++)
+        delete mInlineGroups[g].index;
+    mInlineGroups.clear();
+    for(int p=0; p<mPoolGroups.size(); p++) {
+        for(int g=0; g<mPoolGroups[p].size(); g++)
+            delete mPoolGroups[p][g].index;
+    }
+    mPoolGroups.clear();
+    // the tables of the indexes may be in the prebuilt file
+    if(mPrebuilt) {
+        delete mPrebuilt;
+        mPrebuilt = NULL;
+    }
+    for(int l=0; l<mLaneDemuxers.size(); l++) {
+        if(mLaneDemuxers[l])
+            delete mLaneDemuxers[l];
+    }
+    mLaneDemuxers.clear();
+    if(mOtherLanes) {
+        delete mOtherLanes;
+        mOtherLanes = NULL;
+    }
+}
+
+long Demuxer::indexHoppedReads() {
+    // the pairs of the lane demuxers are merged here too
+    lock_guard<mutex> guard(mHoppedPairsLock);
+    long reads = 0;
+    map<pair<string, string>, long>::iterator iter;
+    for(iter = mHoppedPairs.begin(); iter != mHoppedPairs.end(); iter++)
+        reads += iter->second;
+    return reads;
+}
+
+void Demuxer::addHoppedPairs(DemuxerContext& context) {
+    lock_guard<mutex> guard(mHoppedPairsLock);
+    map<pair<const Demuxer*, uint64>, long>::iterator iter;
+    for(iter = context.hoppedPairs.begin(); iter != context.hoppedPairs.end(); iter++) {
+        // the counts of the lanes are merged by the barcodes
+        const Demuxer* demuxer = iter->first.first;
+        string index1 = demuxer->mIndex1->barcode(iter->first.second >> 32);
+        string index2 = demuxer->mIndex2->barcode(iter->first.second & 0xFFFFFFFFUL);
+        mHoppedPairs[make_pair(index1, index2)] += iter->second;
     }
 }
 
+void Demuxer::writeHoppingReport() {
+    if(mOptions->hoppingReport.empty())
+        return;
+    // the rows and columns are in the order of the sample sheet
+    vector<string> rows, columns;
+    map<string, bool> added1, added2;
+    for(int i=0; i<mOptions->samples.size(); i++) {
+        Sample& s = mOptions->samples[i];
+        if(!added1[s.index1]) {
+            added1[s.index1] = true;
+            rows.push_back(s.index1);
+        }
+        if(!added2[s.index2]) {
+            added2[s.index2] = true;
+            columns.push_back(s.index2);
+        }
+    }
+
+    ofstream out(mOptions->hoppingReport.c_str());
+    if(!out.is_open())
+        error_exit("Failed to write the index hopping report: " + mOptions->hoppingReport);
+    out << "index1\\index2";
+    for(int c=0; c<columns.size(); c++)
+        out << "\t" << columns[c];
+    out << "\n";
+    for(int r=0; r<rows.size(); r++) {
+        out << rows[r];
+        for(int c=0; c<columns.size(); c++) {
+            map<pair<string, string>, long>::iterator iter = mHoppedPairs.find(make_pair(rows[r], columns[c]));
+            out << "\t" << (iter == mHoppedPairs.end() ? 0 : iter->second);
+        }
+        out << "\n";
+    }
+    out.close();
+    mOptions->log("index hopping report written to " + mOptions->hoppingReport);
+}
+
+void Demuxer::initLanes() {
+    int maxLane = 0;
+    bool hasAllLaneSamples = false;
+    for(int i=0; i<mOptions->samples.size(); i++) {
+        maxLane = max(maxLane, mOptions->samples[i].lane);
+        if(mOptions->samples[i].lane == 0)
+            hasAllLaneSamples = true;
+    }
+    mLaneDemuxers.resize(maxLane + 1, NULL);
+    for(int lane=1; lane<=maxLane; lane++) {
+        bool hasSamples = false;
+        for(int i=0; i<mOptions->samples.size(); i++) {
+            if(mOptions->samples[i].lane == lane)
+                hasSamples = true;
+        }
+        if(hasSamples || hasAllLaneSamples) {
+            mOptions->log("building the barcode index of lane " + to_string(lane));
+            mLaneDemuxers[lane] = new Demuxer(mOptions, lane);
+        }
+    }
+    // the lanes not in the sample sheet only have the samples of all lanes
+    if(hasAllLaneSamples)
+        mOtherLanes = new Demuxer(mOptions, DEMUX_OTHER_LANES);
+}
+
+inline Demuxer* Demuxer::laneDemuxer(SimpleRead* r) {
+    int lane = r->getIlluminaLane();
+    if(lane > 0 && lane < mLaneDemuxers.size() && mLaneDemuxers[lane])
+        return mLaneDemuxers[lane];
+    return mOtherLanes;
+}
+
+int Demuxer::demuxByLane(SimpleRead* r, DemuxerContext* context) {
+    Demuxer* demuxer = laneDemuxer(r);
+    if(demuxer == NULL)
+        return DEMUX_UNDETERMINED;
+    return demuxer->demux(r, context);
+}
+
+int Demuxer::demuxByLane(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context) {
+    Demuxer* demuxer = laneDemuxer(r1);
+    if(demuxer == NULL)
+        return DEMUX_UNDETERMINED;
+    return demuxer->demux(r1, r2, context);
+}
+
 void Demuxer::init() {
     if(mOptions == NULL)
         return;
 
-    const char bases[4] = {'A', 'T', 'C', 'G'};
+    if(mOptions->byLane && mLane == 0) {
+        initLanes();
+        return;
+    }
+
+    if(mOptions->matchMode == MATCH_MODE_WHITELIST) {
+        mWhitelist = new WhitelistIndex(mOptions);
+        return;
+    }
 
-    bool sameLength = true;
+    // the samples of this lane
+    vector<int> sampleIds;
     for(int i=0; i<mOptions->samples.size(); i++) {
-        Sample s = mOptions->samples[i];
-        string barcode = s.index1;
+        int lane = mOptions->samples[i].lane;
+        if(mLane == 0 || lane == 0 || lane == mLane)
+            sampleIds.push_back(i);
+    }
+
+    // match index1 and index2 independently if the sample sheet has index2
+    int samplesWithIndex2 = 0;
+    for(int i=0; i<sampleIds.size(); i++) {
+        if(!mOptions->samples[sampleIds[i]].index2.empty())
+            samplesWithIndex2++;
+    }
+    if(mOptions->barcodePlace == BARCODE_AT_BOTH_INDEX && samplesWithIndex2 > 0) {
+        if(samplesWithIndex2 != sampleIds.size())
+            error_exit("For dual index demultiplexing, every record should have both index1 and index2");
+        mDualIndex = true;
+    }
+
+    // every building thread enumerates all the mutants, so more threads than cores only slow it down
+    int buildThreads = min(mOptions->threadNum, max(1, (int)thread::hardware_concurrency()));
+
+    if(mOptions->inlinePlace != BARCODE_PLACE_UNKNOWN) {
+        initPools(sampleIds, buildThreads);
+        return;
+    }
+
+    if(mOptions->barcodePlace == BARCODE_AT_READ1 || mOptions->barcodePlace == BARCODE_AT_READ2) {
+        initInlineGroups(mInlineGroups, sampleIds, mOptions->mismatch, buildThreads);
+        if(mInlineGroups.size() > 1)
+            mOptions->log("searching the inline barcodes at " + to_string(mInlineGroups.size()) + " (start, length) places");
+        buildIndexes();
+        return;
+    }
+
+    mIndex1 = new BarcodeIndex(mOptions->matchMode, mOptions->mismatch);
+    mIndex1->setMinPosterior(mOptions->minPosterior);
+    mIndex1->setThreadNum(buildThreads);
+    if(mDualIndex) {
+        mIndex2 = new BarcodeIndex(mOptions->matchMode, mOptions->mismatch2);
+        mIndex2->setThreadNum(buildThreads);
+    }
 
-        if(barcode.empty()) {
-            error_exit("You should specify barcode for each record");
+    vector<int> ids1, ids2;
+    for(int i=0; i<sampleIds.size(); i++) {
+        Sample& s = mOptions->samples[sampleIds[i]];
+        ids1.push_back(mIndex1->addBarcode(s.index1));
+        if(mDualIndex)
+            ids2.push_back(mIndex2->addBarcode(s.index2));
+    }
+    buildIndexes();
+
+    if(mDualIndex) {
+        // only the pairs in the sample sheet are stored, sorted by their keys
+        for(int i=0; i<ids1.size(); i++)
+            mPairKeys.push_back(pairKey(ids1[i], ids2[i]));
+        sort(mPairKeys.begin(), mPairKeys.end());
+        mPairKeys.erase(unique(mPairKeys.begin(), mPairKeys.end()), mPairKeys.end());
+        mPairSample.resize(mPairKeys.size(), DEMUX_UNDETERMINED);
+        for(int i=0; i<ids1.size(); i++) {
+            long p = lower_bound(mPairKeys.begin(), mPairKeys.end(), pairKey(ids1[i], ids2[i])) - mPairKeys.begin();
+            assignSample(mPairSample[p], sampleIds[i]);
         }
+    } else {
+        mBarcodeSample.resize(mIndex1->size(), DEMUX_UNDETERMINED);
+        for(int i=0; i<ids1.size(); i++)
+            assignSample(mBarcodeSample[ids1[i]], sampleIds[i]);
+    }
+}
 
-        if(barcode.length()>30) {
-            error_exit("Barcode length should be <= 30bp ");
+void Demuxer::initInlineGroups(vector<InlineBarcodeGroup>& groups, const vector<int>& sampleIds, int mismatch, int buildThreads) {
+    // the samples with a same barcode start and length share a lookup structure
+    map<pair<int, int>, int> groupIds;
+    for(int i=0; i<sampleIds.size(); i++) {
+        Sample& s = mOptions->samples[sampleIds[i]];
+        const string& barcode = s.inlineBarcode.empty() ? s.index1 : s.inlineBarcode;
+        pair<int, int> place(s.barcodeStart, barcode.length());
+        map<pair<int, int>, int>::iterator iter = groupIds.find(place);
+        int g = 0;
+        if(iter == groupIds.end()) {
+            g = groups.size();
+            groupIds[place] = g;
+            InlineBarcodeGroup group;
+            group.start = place.first;
+            group.length = place.second;
+            group.index = new BarcodeIndex(mOptions->matchMode, mismatch);
+            group.index->setMinPosterior(mOptions->minPosterior);
+            group.index->setThreadNum(buildThreads);
+            groups.push_back(group);
+        } else {
+            g = iter->second;
         }
+        InlineBarcodeGroup& group = groups[g];
+        int id = group.index->addBarcode(barcode);
+        if(id >= group.barcodeSample.size())
+            group.barcodeSample.resize(id + 1, DEMUX_UNDETERMINED);
+        assignSample(group.barcodeSample[id], sampleIds[i]);
+    }
+}
+
+void Demuxer::assignSample(int& output, int sampleId) {
+    Sample& s = mOptions->samples[sampleId];
+    if(output >= 0 && output != s.output)
+        cerr << "WARNING: " << mOptions->outputFiles[output] << " and " << s.file << " have a same barcode, only the latter is used" << endl;
+    output = s.output;
+}
+
+void Demuxer::initPools(const vector<int>& sampleIds, int buildThreads) {
+    // the pool index is in the read name, it has no qualities and cannot be shifted
+    int poolMatchMode = mOptions->matchMode;
+    if(poolMatchMode == MATCH_MODE_QUALITY || poolMatchMode == MATCH_MODE_EDIT)
+        poolMatchMode = mOptions->mismatch <= 2 ? MATCH_MODE_TABLE : MATCH_MODE_HAMMING;
+    mIndex1 = new BarcodeIndex(poolMatchMode, mOptions->mismatch);
+    mIndex1->setThreadNum(buildThreads);
 
-        long key = kmer2key(barcode);
-        if(key < 0)
-            error_exit("Barcode can only contain A/T/C/G: " + barcode);
-
-        mIndexSample[key] = i;
-
-        addKeyToHashTable(key, i);
-
-        if(mOptions->mismatch == 1) {
-            for(int p=0; p<barcode.length(); p++) {
-                char origin = barcode[p];
-                for(int b=0; b<4; b++) {
-                    if(bases[b] == origin)
-                        continue;
-                    string mutant = barcode;
-                    mutant[p] = bases[b];
-                    long key = kmer2key(mutant);
-                    mIndexSample[key] = i;
-                    addKeyToHashTable(key, i);
-                }
-            }
+    // the samples of each pool
+    vector<vector<int> > poolSamples;
+    for(int i=0; i<sampleIds.size(); i++) {
+        int pool = mIndex1->addBarcode(mOptions->samples[sampleIds[i]].index1);
+        if(pool >= poolSamples.size())
+            poolSamples.resize(pool + 1);
+        poolSamples[pool].push_back(sampleIds[i]);
+    }
+    mPoolGroups.resize(poolSamples.size());
+    for(int p=0; p<poolSamples.size(); p++)
+        initInlineGroups(mPoolGroups[p], poolSamples[p], mOptions->inlineMismatch, buildThreads);
+    mOptions->log("hierarchical demultiplexing: " + to_string(poolSamples.size()) + " pools, " + to_string(sampleIds.size()) + " samples");
+    buildIndexes();
+}
+
+void Demuxer::buildIndexes() {
+    vector<BarcodeIndex*> indexes;
+    if(mIndex1)
+        indexes.push_back(mIndex1);
+    if(mIndex2)
+        indexes.push_back(mIndex2);
+    for(int g=0; g<mInlineGroups.size(); g++)
+        indexes.push_back(mInlineGroups[g].index);
+    for(int p=0; p<mPoolGroups.size(); p++) {
+        for(int g=0; g<mPoolGroups[p].size(); g++)
+            indexes.push_back(mPoolGroups[p][g].index);
+    }
+
+    if(mOptions->autoMismatch) {
+        for(int i=0; i<indexes.size(); i++) {
+            indexes[i]->autoMismatch();
+            reportMismatch(indexes[i]);
         }
+    }
 
-        if(mOptions->mismatch == 2) {
-            for(int p=0; p<barcode.length(); p++) {
-                char originP = barcode[p];
-                for(int q=0; q<barcode.length(); q++) {
-                    if(p==q)
-                        continue;
-                    char originQ = barcode[q];
-                    for(int b1=0; b1<4; b1++) {
-                        if(bases[b1] == originP)
-                            continue;
-                        for(int b2=0; b2<4; b2++) {
-                            if(bases[b2] == originQ)
-                                continue;
-                            string mutant = barcode;
-                            mutant[p] = bases[b1];
-                            mutant[q] = bases[b2];
-                            long key = kmer2key(mutant);
-                            addKeyToHashTable(key, i);
-                            mIndexSample[key] = i;
-                        }
-                    }
-                }
-            }
+    string filename = mOptions->prebuiltIndexFile;
+    // each lane has its own tables
+    if(!filename.empty() && mLane != 0)
+        filename += mLane > 0 ? ".lane" + to_string(mLane) : ".lanes";
+    if(mOptions->matchMode != MATCH_MODE_TABLE || filename.empty()) {
+        for(int i=0; i<indexes.size(); i++)
+            indexes[i]->build();
+        return;
+    }
+
+    uint64 signature = BARCODE_TABLE_FILE_VERSION;
+    for(int i=0; i<indexes.size(); i++)
+        signature = signature * 0x9E3779B97F4A7C15UL ^ indexes[i]->signature();
+
+    mPrebuilt = new MappedFile();
+    if(mPrebuilt->open(filename) && BarcodeIndex::loadTables(mPrebuilt, signature, indexes)) {
+        mOptions->log("barcode tables loaded from " + filename);
+        return;
+    }
+
+    for(int i=0; i<indexes.size(); i++)
+        indexes[i]->build();
+    BarcodeIndex::saveTables(filename, signature, indexes);
+    mPrebuilt->close();
+    mOptions->log("barcode tables saved to " + filename);
+}
+
+void Demuxer::reportMismatch(BarcodeIndex* index) {
+    if(index->size() == 0)
+        return;
+    int minDist = HAMMING_MAX_LEN + 1;
+    map<int, int> barcodesOfMismatch;
+    for(int id=0; id<index->size(); id++) {
+        int dist = index->nearestDistance(id);
+        minDist = min(minDist, dist);
+        barcodesOfMismatch[index->mismatchOf(id)]++;
+        mOptions->log(index->barcode(id) + ": nearest distance " + (dist > HAMMING_MAX_LEN ? string("none") : to_string(dist)) + ", mismatch " + to_string(index->mismatchOf(id)));
+    }
+    cerr << index->size() << " barcodes, minimum distance " << (minDist > HAMMING_MAX_LEN ? string("none") : to_string(minDist)) << ", mismatch:";
+    for(map<int, int>::iterator iter = barcodesOfMismatch.begin(); iter != barcodesOfMismatch.end(); iter++)
+        cerr << " " << iter->second << " barcodes with " << iter->first;
+    cerr << endl;
+}
+
+void Demuxer::selectKernels() {
+    int place = mOptions->barcodePlace;
+    if(mOptions->byLane && mLane == 0) {
+        mSingleEndKernel = &Demuxer::demuxByLane;
+        mPairedEndKernel = &Demuxer::demuxByLane;
+    } else if(mWhitelist) {
+        switch(place) {
+            case BARCODE_AT_READ1: selectWrappers<&Demuxer::demuxWhitelist<BARCODE_AT_READ1> >(); break;
+            case BARCODE_AT_READ2: selectWrappers<&Demuxer::demuxWhitelist<BARCODE_AT_READ2> >(); break;
+            case BARCODE_AT_INDEX1: selectWrappers<&Demuxer::demuxWhitelist<BARCODE_AT_INDEX1> >(); break;
+            case BARCODE_AT_INDEX2: selectWrappers<&Demuxer::demuxWhitelist<BARCODE_AT_INDEX2> >(); break;
+            case BARCODE_AT_BOTH_INDEX: selectWrappers<&Demuxer::demuxWhitelist<BARCODE_AT_BOTH_INDEX> >(); break;
+            default: error_exit("Unknown barcode place");
+        }
+    } else if(!mPoolGroups.empty()) {
+        bool edit = mOptions->matchMode == MATCH_MODE_EDIT;
+        switch(place) {
+            case BARCODE_AT_INDEX1: edit ? selectWrappers<&Demuxer::demuxPooled<BARCODE_AT_INDEX1, true> >() : selectWrappers<&Demuxer::demuxPooled<BARCODE_AT_INDEX1, false> >(); break;
+            case BARCODE_AT_INDEX2: edit ? selectWrappers<&Demuxer::demuxPooled<BARCODE_AT_INDEX2, true> >() : selectWrappers<&Demuxer::demuxPooled<BARCODE_AT_INDEX2, false> >(); break;
+            case BARCODE_AT_BOTH_INDEX: edit ? selectWrappers<&Demuxer::demuxPooled<BARCODE_AT_BOTH_INDEX, true> >() : selectWrappers<&Demuxer::demuxPooled<BARCODE_AT_BOTH_INDEX, false> >(); break;
+            default: error_exit("Unknown barcode place");
+        }
+    } else if(!mInlineGroups.empty()) {
+        if(mOptions->matchMode == MATCH_MODE_EDIT)
+            selectWrappers<&Demuxer::demuxInline<true> >();
+        else
+            selectWrappers<&Demuxer::demuxInline<false> >();
+    } else if(mDualIndex) {
+        selectWrappers<&Demuxer::demuxDualIndex>();
+    } else {
+        switch(place) {
+            case BARCODE_AT_INDEX1: selectWrappers<&Demuxer::demuxIndex<BARCODE_AT_INDEX1> >(); break;
+            case BARCODE_AT_INDEX2: selectWrappers<&Demuxer::demuxIndex<BARCODE_AT_INDEX2> >(); break;
+            case BARCODE_AT_BOTH_INDEX: selectWrappers<&Demuxer::demuxIndex<BARCODE_AT_BOTH_INDEX> >(); break;
+            default: error_exit("Unknown barcode place");
         }
     }
 }
 
-void Demuxer::addKeyToHashTable(long key, int pos) {
-    int hashval = hash(key);
-    if(mHashTable[hashval] == -1)
-        mHashTable[hashval] = pos;
+template<long (Demuxer::*KERNEL)(SimpleRead*)>
+void Demuxer::selectWrappers() {
+    if(initCacheKey())
+        selectWrappers<KERNEL, true>();
     else
-        mHashTable[hashval] = HASH_COLLISION;
+        selectWrappers<KERNEL, false>();
 }
 
-int Demuxer::hash(long key) {
-    return abs(key * 1713137323L) & (mHashTableLen-1);
+template<long (Demuxer::*KERNEL)(SimpleRead*), bool CACHE>
+void Demuxer::selectWrappers() {
+    bool umi = !mOptions->umiSegments.empty();
+    // the index is in the read names of both mates, so the mate having the inline barcode is demultiplexed
+    bool read2 = mOptions->inlineBarcodePlace() == BARCODE_AT_READ2;
+    if(umi) {
+        mSingleEndKernel = &Demuxer::demuxSingleEnd<KERNEL, true, CACHE>;
+        mPairedEndKernel = read2 ? &Demuxer::demuxPairedEnd<KERNEL, true, true, CACHE> : &Demuxer::demuxPairedEnd<KERNEL, false, true, CACHE>;
+    } else {
+        mSingleEndKernel = &Demuxer::demuxSingleEnd<KERNEL, false, CACHE>;
+        mPairedEndKernel = read2 ? &Demuxer::demuxPairedEnd<KERNEL, true, false, CACHE> : &Demuxer::demuxPairedEnd<KERNEL, false, false, CACHE>;
+    }
 }
 
-int Demuxer::demux(SimpleRead* r) {
-    long key = 0;
-    if(mOptions->barcodePlace == BARCODE_AT_READ1 || mOptions->barcodePlace == BARCODE_AT_READ2) {
-        if(mOptions->barcodeStart -1 + mOptions->barcodeLength > r->seqLen())
+template<long (Demuxer::*KERNEL)(SimpleRead*), bool UMI, bool CACHE>
+int Demuxer::demuxSingleEnd(SimpleRead* r, DemuxerContext* context) {
+    long sample = CACHE && context ? demuxCached<KERNEL>(r, &context->cache) : (this->*KERNEL)(r);
+    if(sample <= DEMUX_INDEX_HOPPED)
+        return countHopped(sample, context);
+    if(UMI && sample >= 0)
+        extractUmi(r, NULL);
+    return sample;
+}
+
+template<long (Demuxer::*KERNEL)(SimpleRead*), bool READ2, bool UMI, bool CACHE>
+int Demuxer::demuxPairedEnd(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context) {
+    SimpleRead* r = READ2 ? r2 : r1;
+    long sample = CACHE && context ? demuxCached<KERNEL>(r, &context->cache) : (this->*KERNEL)(r);
+    if(sample <= DEMUX_INDEX_HOPPED)
+        return countHopped(sample, context);
+    if(UMI && sample >= 0)
+        extractUmi(r1, r2);
+    return sample;
+}
+
+inline int Demuxer::countHopped(long result, DemuxerContext* context) {
+    if(context)
+        context->hoppedPairs[make_pair((const Demuxer*)this, DEMUX_INDEX_HOPPED - result)]++;
+    return DEMUX_INDEX_HOPPED;
+}
+
+bool Demuxer::initCacheKey() {
+    // a table lookup is already a single probe
+    if(mOptions->matchMode == MATCH_MODE_TABLE)
+        return false;
+    int place = mOptions->barcodePlace;
+    mCacheKeyIndex = place == BARCODE_AT_INDEX1 || place == BARCODE_AT_INDEX2 || place == BARCODE_AT_BOTH_INDEX;
+
+    // the bases of the inline barcodes in the read
+    int start = INT_MAX;
+    int end = 0;
+    for(int g=0; g<mInlineGroups.size(); g++) {
+        start = min(start, mInlineGroups[g].start);
+        end = max(end, mInlineGroups[g].start + mInlineGroups[g].length);
+    }
+    for(int p=0; p<mPoolGroups.size(); p++) {
+        for(int g=0; g<mPoolGroups[p].size(); g++) {
+            start = min(start, mPoolGroups[p][g].start);
+            end = max(end, mPoolGroups[p][g].start + mPoolGroups[p][g].length);
+        }
+    }
+    if(mWhitelist && (place == BARCODE_AT_READ1 || place == BARCODE_AT_READ2)) {
+        start = mOptions->barcodeStart;
+        end = mOptions->barcodeStart + mOptions->barcodeLength;
+    }
+    if(end > 0) {
+        // the quality-aware match of an inline barcode also depends on its qualities
+        if(mOptions->matchMode == MATCH_MODE_QUALITY)
+            return false;
+        if(mOptions->matchMode == MATCH_MODE_EDIT) {
+            start = max(0, start - mOptions->maxShift);
+            end += mOptions->maxShift;
+        }
+        mCacheKeyStart = start;
+        mCacheKeyEnd = end;
+    }
+    return mCacheKeyIndex || mCacheKeyEnd > 0;
+}
+
+inline int Demuxer::cacheKey(SimpleRead* r, char* key) {
+    int keyLen = 0;
+    if(mCacheKeyIndex) {
+        // the indexes are the last field of the read name, the name line ends at seqStart() - 1
+        const char* data = r->data();
+        int end = (int)r->seqStart() - 1;
+        int start = end;
+        while(start > 0 && data[start - 1] != ':')
+            start--;
+        keyLen = end - start;
+        if(keyLen + 1 > DEMUX_CACHE_MAX_KEY)
+            return -1;
+        memcpy(key, data + start, keyLen);
+        // separate the index from the bases
+        key[keyLen++] = '\n';
+    }
+    if(mCacheKeyEnd > 0) {
+        // a shorter read is keyed by the bases it has, the barcodes not fitting in it are not matched,
+        // and the shorter key never equals the key of a full read
+        int len = max(0, min(mCacheKeyEnd, (int)r->seqLen()) - mCacheKeyStart);
+        if(keyLen + len > DEMUX_CACHE_MAX_KEY)
             return -1;
-        key = kmer2key(r->data() + r->seqStart() + mOptions->barcodeStart, mOptions->barcodeLength);
-    } else if(mOptions->barcodePlace == BARCODE_AT_INDEX1) {
+        memcpy(key + keyLen, r->data() + r->seqStart() + mCacheKeyStart, len);
+        keyLen += len;
+    }
+    return keyLen;
+}
+
+template<long (Demuxer::*KERNEL)(SimpleRead*)>
+inline long Demuxer::demuxCached(SimpleRead* r, DemuxCache* cache) {
+    char key[DEMUX_CACHE_MAX_KEY];
+    int keyLen = cacheKey(r, key);
+    if(keyLen < 0)
+        return (this->*KERNEL)(r);
+    DemuxCacheEntry* entry = cache->find(this, key, keyLen);
+    if(entry) {
+        if(entry->spanLen > 0)
+            r->setBarcodeSpan(entry->spanStart, entry->spanLen);
+        return entry->output;
+    }
+    long sample = (this->*KERNEL)(r);
+    cache->store(this, key, keyLen, sample, r->barcodeStart(), r->barcodeLen());
+    return sample;
+}
+
+template<int PLACE>
+inline bool Demuxer::locateBarcode(SimpleRead* r, const char*& data1, size_t& len1, const char*& data2, size_t& len2) {
+    data2 = NULL;
+    len2 = 0;
+    if(PLACE == BARCODE_AT_READ1 || PLACE == BARCODE_AT_READ2) {
+        if(mOptions->barcodeStart + mOptions->barcodeLength > r->seqLen())
+            return false;
+        data1 = r->data() + r->seqStart() + mOptions->barcodeStart;
+        len1 = mOptions->barcodeLength;
+    } else if(PLACE == BARCODE_AT_INDEX1) {
         unsigned int s1, l1;
         bool hasIndex1 = r->getIlluminaIndex1Place(s1, l1);
         if(!hasIndex1)
             error_exit("Read doesn't have INDEX 1, please confirm that it is Illumina data.");
-        key = kmer2key(r->data() + s1, l1);
-    } else if(mOptions->barcodePlace == BARCODE_AT_INDEX2) {
+        data1 = r->data() + s1;
+        len1 = l1;
+    } else if(PLACE == BARCODE_AT_INDEX2) {
         unsigned int s2, l2;
         bool hasIndex2 = r->getIlluminaIndex2Place(s2, l2);
         if(!hasIndex2)
             error_exit("Read doesn't have INDEX 2, please confirm that it is Illumina data.");
-        key = kmer2key(r->data() + s2, l2);
-    } else if(mOptions->barcodePlace == BARCODE_AT_BOTH_INDEX) {
+        data1 = r->data() + s2;
+        len1 = l2;
+    } else if(PLACE == BARCODE_AT_BOTH_INDEX) {
         unsigned int s1, l1, s2, l2;
         bool hasTwoIndexes = r->getIlluminaBothIndexPlaces(s1, l1, s2, l2);
         if(!hasTwoIndexes)
             error_exit("Read doesn't have dual indexes, please confirm that it is paired-end Illumina data.");
-        key = kmer2keyTwoParts(r->data() + s1, l1, r->data() + s2, l2);
-    } else 
-        return -1;
-
-    if(key < 0)
-        return -1;
-    int hashval = hash(key);
-    if(mHashTable[hashval]>=0)
-        return mHashTable[hashval];
-    else if(mHashTable[hashval] == HASH_COLLISION)
-        return mIndexSample[key];
-    else
-        return -1;
+        data1 = r->data() + s1;
+        len1 = l1;
+        data2 = r->data() + s2;
+        len2 = l2;
+    } else
+        return false;
+    return true;
 }
 
-int Demuxer::demux(SimpleRead* r1, SimpleRead* r2) {
-    if(mOptions->barcodePlace == BARCODE_AT_READ2)
-        return demux(r2);
-    else 
-        return demux(r1);
+template<bool EDIT>
+long Demuxer::demuxInline(SimpleRead* r) {
+    return matchInline<EDIT>(r, mInlineGroups);
 }
 
-long Demuxer::kmer2key(string& str) {
-    return kmer2key(str.c_str(), str.length());
+template<bool EDIT>
+inline int Demuxer::matchInline(SimpleRead* r, vector<InlineBarcodeGroup>& groups) {
+    int best = DEMUX_UNDETERMINED;
+    int bestDist = 0;
+    int bestGroup = -1;
+    int bestStart = 0;
+    int bestLength = 0;
+    for(int g=0; g<groups.size(); g++) {
+        InlineBarcodeGroup& group = groups[g];
+        int start = group.start;
+        int length = group.length;
+        int dist = 0;
+        int id = -1;
+        if(EDIT) {
+            // search a window allowing the barcode to slide by at most maxShift bases
+            int windowStart = max(0, group.start - mOptions->maxShift);
+            int windowEnd = min((int)r->seqLen(), group.start + group.length + mOptions->maxShift);
+            if(windowEnd <= windowStart)
+                continue;
+            const char* window = r->data() + r->seqStart() + windowStart;
+            id = group.index->matchInWindow(window, windowEnd - windowStart, group.start - windowStart, dist, start, length);
+            start += windowStart;
+        } else {
+            if(group.start + group.length > r->seqLen())
+                continue;
+            const char* data = r->data() + r->seqStart() + group.start;
+            const char* qual = r->data() + r->qualStart() + group.start;
+            id = group.index->match(data, group.length, dist, qual);
+        }
+        if(id < 0)
+            continue;
+        int sample = group.barcodeSample[id];
+        if(bestGroup < 0 || dist < bestDist) {
+            best = sample;
+            bestDist = dist;
+            bestGroup = g;
+            bestStart = start;
+            bestLength = length;
+        } else if(dist == bestDist && sample != best) {
+            // matched different samples at different places with a same distance
+            best = DEMUX_UNDETERMINED;
+        }
+    }
+    if(best < 0)
+        return DEMUX_UNDETERMINED;
+    r->setBarcodeSpan(bestStart, bestLength);
+    return best;
 }
 
-long Demuxer::kmer2key(const char* data, size_t len) {
-    if(len > 30)
-        error_exit("Index length cannot be longer than 30");
-    long kmer = 0;
-    for(int k=0; k<len; k++) {
-        int val = base2val(data[k]);
-        if(val < 0) {
+template<int PLACE>
+inline int Demuxer::matchIndex(SimpleRead* r) {
+    const char* data1;
+    const char* data2;
+    size_t len1, len2;
+    if(!locateBarcode<PLACE>(r, data1, len1, data2, len2))
+        return -1;
+
+    int dist = 0;
+    if(PLACE == BARCODE_AT_BOTH_INDEX) {
+        // the two parts of a dual index barcode are matched as a whole
+        if(len1 + len2 > HAMMING_MAX_LEN)
             return -1;
-        }
-        kmer = (kmer<<2) | val;
+        char buf[HAMMING_MAX_LEN];
+        memcpy(buf, data1, len1);
+        memcpy(buf + len1, data2, len2);
+        return mIndex1->match(buf, len1 + len2, dist);
     }
-    return kmer;
+    return mIndex1->match(data1, len1, dist);
 }
 
-long Demuxer::kmer2keyTwoParts(const char* data1, size_t len1, const char* data2, size_t len2) {
-    if(len1 + len2 > 30)
-        error_exit("Index length cannot be longer than 30");
-    long kmer = 0;
-    for(int k=0; k<len1; k++) {
-        int val = base2val(data1[k]);
-        if(val < 0) {
-            return -1;
-        }
-        kmer = (kmer<<2) | val;
+template<int PLACE>
+long Demuxer::demuxIndex(SimpleRead* r) {
+    int id = matchIndex<PLACE>(r);
+    if(id < 0)
+        return DEMUX_UNDETERMINED;
+    return mBarcodeSample[id];
+}
+
+template<int PLACE, bool EDIT>
+long Demuxer::demuxPooled(SimpleRead* r) {
+    int pool = matchIndex<PLACE>(r);
+    if(pool < 0)
+        return DEMUX_UNDETERMINED;
+    return matchInline<EDIT>(r, mPoolGroups[pool]);
+}
+
+long Demuxer::demuxDualIndex(SimpleRead* r) {
+    const char* data1;
+    const char* data2;
+    size_t len1, len2;
+    if(!locateBarcode<BARCODE_AT_BOTH_INDEX>(r, data1, len1, data2, len2))
+        return DEMUX_UNDETERMINED;
+
+    int dist1 = 0;
+    int dist2 = 0;
+    int id1 = mIndex1->match(data1, len1, dist1);
+    if(id1 < 0)
+        return DEMUX_UNDETERMINED;
+    int id2 = mIndex2->match(data2, len2, dist2);
+    if(id2 < 0)
+        return DEMUX_UNDETERMINED;
+    uint64 pair = pairKey(id1, id2);
+    vector<uint64>::const_iterator iter = lower_bound(mPairKeys.begin(), mPairKeys.end(), pair);
+    if(iter == mPairKeys.end() || *iter != pair)
+        return DEMUX_INDEX_HOPPED - (long)pair;
+    return mPairSample[iter - mPairKeys.begin()];
+}
+
+template<int PLACE>
+long Demuxer::demuxWhitelist(SimpleRead* r) {
+    const char* data1;
+    const char* data2;
+    size_t len1, len2;
+    if(!locateBarcode<PLACE>(r, data1, len1, data2, len2))
+        return DEMUX_UNDETERMINED;
+
+    int dist = 0;
+    if(PLACE == BARCODE_AT_BOTH_INDEX) {
+        if(len1 + len2 > HAMMING_MAX_LEN)
+            return DEMUX_UNDETERMINED;
+        char buf[HAMMING_MAX_LEN];
+        memcpy(buf, data1, len1);
+        memcpy(buf + len1, data2, len2);
+        return mWhitelist->match(buf, len1 + len2, dist);
     }
-    for(int k=0; k<len2; k++) {
-        int val = base2val(data2[k]);
-        if(val < 0) {
-            return -1;
-        }
-        kmer = (kmer<<2) | val;
-    }
-    return kmer;
-}
-
-long Demuxer::base2val(char base) {
-    switch(base){
-        case 'A':
-            return 0;
-        case 'T':
-            return 1;
-        case 'C':
-            return 2;
-        case 'G':
-            return 3;
-        default:
-            return -1;
+    int sample = mWhitelist->match(data1, len1, dist);
+    if((PLACE == BARCODE_AT_READ1 || PLACE == BARCODE_AT_READ2) && sample >= 0)
+        r->setBarcodeSpan(mOptions->barcodeStart, mOptions->barcodeLength);
+    return sample;
+}
+
+void Demuxer::extractUmi(SimpleRead* r1, SimpleRead* r2) {
+    // the UMI bases are copied to each read, since the mates are written and released by different writers
+    char umi[UMI_MAX_LEN + 1];
+    int umiLen = 0;
+    for(int i=0; i<mOptions->umiSegments.size(); i++) {
+        UmiSegment& seg = mOptions->umiSegments[i];
+        SimpleRead* r = seg.read2 ? r2 : r1;
+        if(r == NULL)
+            continue;
+        int len = min(seg.length, (int)r->seqLen() - seg.start);
+        if(len <= 0 || umiLen + len + 1 > UMI_MAX_LEN)
+            continue;
+        // the segments are joined by _
+        if(umiLen > 0)
+            umi[umiLen++] = '_';
+        memcpy(umi + umiLen, r->data() + r->seqStart() + seg.start, len);
+        umiLen += len;
     }
+    r1->setUmi(umi, umiLen);
+    if(r2)
+        r2->setUmi(umi, umiLen);
 }
 
 bool Demuxer::test(){
-    Demuxer d(NULL);
     string s1("AGTCAGAA");
     string s2("ATTCAGAA");
-    cout << d.kmer2key(s1) << endl;
-    cout << d.kmer2key(s2) << endl;
+    if(BarcodeIndex::kmer2key(s1.c_str(), s1.length()) == BarcodeIndex::kmer2key(s2.c_str(), s2.length()))
+        return false;
 
-    return true;
-}
\ No newline at end of file
+    // inline barcodes at base 5 of read1, the cache is keyed by the barcode bases only
+    Options opt;
+    opt.barcodePlace = BARCODE_AT_READ1;
+    opt.matchMode = MATCH_MODE_HAMMING;
+    opt.mismatch = 1;
+    opt.threadNum = 1;
+    const char* barcodes[2] = {"AGTCAGAA", "CCGTTACG"};
+    for(int i=0; i<2; i++) {
+        Sample sample;
+        sample.index1 = barcodes[i];
+        sample.barcodeStart = 5;
+        sample.output = i;
+        opt.samples.push_back(sample);
+    }
+    Demuxer demuxer(&opt);
+    DemuxerContext context;
+    // the reads differ before the barcode, and the last one is too short for it
+    const char* reads[4] = {"@r1\nTTTTTCCGTTACGGG\n+\nIIIIIIIIIIIIIII\n", "@r2\nGACTACCGTAACGTA\n+\nIIIIIIIIIIIIIII\n",
+        "@r3\nCAGGTCCGTTACGTC\n+\nIIIIIIIIIIIIIII\n", "@r4\nCAGGTCCGTTA\n+\nIIIIIIIIIII\n"};
+    const int expected[4] = {1, 1, 1, DEMUX_UNDETERMINED};
+    for(int i=0; i<4; i++) {
+        int len = strlen(reads[i]);
+        char* data = (char*)tmalloc(len);
+        memcpy(data, reads[i], len);
+        SimpleRead read(data, len);
+        if(demuxer.demux(&read, &context) != expected[i])
+            return false;
+    }
+    // r3 has the bases of r1 after the barcode start
+    return context.cache.hits() == 1 && context.cache.misses() == 3;
+}
@@ -28,35 +28,161 @@ SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
 #include "options.h"
 #include "simpleread.h"
-#include <map>
+#include "barcodeindex.h"
+#include "whitelistindex.h"
+#include "demuxcache.h"
 
 using namespace std;
 
-const int HASH_COLLISION = -2;
+// the results of demux() other than a sample
+const int DEMUX_UNDETERMINED = -1;
+// both index1 and index2 are matched, but they are not a pair in the sample sheet
+// a kernel returns DEMUX_INDEX_HOPPED - pairKey(id1, id2), so that the pair can be counted
+const int DEMUX_INDEX_HOPPED = -2;
+// the lane of the demuxer for the lanes without their own samples in a sample sheet with lanes
+const int DEMUX_OTHER_LANES = -1;
+
+class Demuxer;
+
+// the state of a demuxer thread, so that the threads share nothing on the per-read path
+struct DemuxerContext {
+    DemuxCache cache;
+    // the reads of each unexpected (index1, index2) pair, keyed by the demuxer and pairKey(id1, id2)
+    map<pair<const Demuxer*, uint64>, long> hoppedPairs;
+};
+
+// the samples whose inline barcodes are at a same place of read1/read2
+struct InlineBarcodeGroup {
+    int start;
+    int length;
+    BarcodeIndex* index;
+    // the output (Sample::output) of each barcode in index
+    vector<int> barcodeSample;
+};
 
+// The demux path is specialized for the barcode place and match mode. A kernel is selected once by selectKernels(),
+// so that the per-read path has no branch on the options, and the kernel is inlined into the single-end/paired-end wrapper.
 class Demuxer{
 public:
-    Demuxer(Options* opt);
+    // lane 0 demultiplexes all the lanes, otherwise only the samples of this lane (and of all lanes) are used
+    Demuxer(Options* opt, int lane = 0);
     ~Demuxer();
-    int demux(SimpleRead* r);
-    int demux(SimpleRead* r1, SimpleRead* r2);
+    // the context of a demuxer thread caches the recent raw barcodes and counts the hopped pairs, it can be NULL
+    inline int demux(SimpleRead* r, DemuxerContext* context = NULL) {return (this->*mSingleEndKernel)(r, context);}
+    inline int demux(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context = NULL) {return (this->*mPairedEndKernel)(r1, r2, context);}
+    // the hopped reads merged by addHoppedPairs()
+    long indexHoppedReads();
+    // merge the hopped pairs counted by a demuxer thread, called when the thread exits
+    void addHoppedPairs(DemuxerContext& context);
+    // write the (index1, index2) matrix of the hopped reads to Options::hoppingReport
+    void writeHoppingReport();
     static bool test();
 
 private:
     void init();
-    inline long kmer2key(const char* data, size_t len);
-    inline long kmer2keyTwoParts(const char* data1, size_t len1, const char* data2, size_t len2) ;
-    inline long kmer2key(string& str);
-    inline long base2val(char base);
-    inline int hash(long key);
-    inline void addKeyToHashTable(long key, int pos);
+    // build the indexes, or load them from the prebuilt index file in table match mode
+    void buildIndexes();
+    // print the distances between the barcodes and the picked mismatches of an index
+    void reportMismatch(BarcodeIndex* index);
+    // group the inline barcodes of the samples by their (start, length) places
+    void initInlineGroups(vector<InlineBarcodeGroup>& groups, const vector<int>& sampleIds, int mismatch, int buildThreads);
+    // for hierarchical demultiplexing, index the pool barcodes, and group the inline barcodes of each pool
+    void initPools(const vector<int>& sampleIds, int buildThreads);
+    // for a sample sheet with lanes, a demuxer is built for each lane
+    void initLanes();
+    // set the output of a barcode to the output of a sample
+    void assignSample(int& output, int sampleId);
+    void selectKernels();
+    template<long (Demuxer::*KERNEL)(SimpleRead*)>
+    void selectWrappers();
+    template<long (Demuxer::*KERNEL)(SimpleRead*), bool CACHE>
+    void selectWrappers();
+    template<long (Demuxer::*KERNEL)(SimpleRead*), bool UMI, bool CACHE>
+    int demuxSingleEnd(SimpleRead* r, DemuxerContext* context);
+    template<long (Demuxer::*KERNEL)(SimpleRead*), bool READ2, bool UMI, bool CACHE>
+    int demuxPairedEnd(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context);
+    // count a kernel result encoding a hopped pair, and return DEMUX_INDEX_HOPPED
+    inline int countHopped(long result, DemuxerContext* context);
+    inline static uint64 pairKey(int id1, int id2) {return ((uint64)id1 << 32) | (uint64)id2;}
+    // decide what the result of the kernel depends on, false if it is not worth caching
+    bool initCacheKey();
+    // copy the raw barcode bytes of a read to key, -1 if they are too long to be cached
+    inline int cacheKey(SimpleRead* r, char* key);
+    // run the kernel, or take its result of a same raw barcode from the cache
+    template<long (Demuxer::*KERNEL)(SimpleRead*)>
+    inline long demuxCached(SimpleRead* r, DemuxCache* cache);
+
+    // the kernels for each barcode place and match mode
+    // match the inline barcode at the place of every group, the nearest one wins
+    template<bool EDIT>
+    long demuxInline(SimpleRead* r);
+    template<int PLACE>
+    long demuxIndex(SimpleRead* r);
+    // the read is demultiplexed by the demuxer of its lane
+    int demuxByLane(SimpleRead* r, DemuxerContext* context);
+    int demuxByLane(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context);
+    inline Demuxer* laneDemuxer(SimpleRead* r);
+    // match the pool index, then the inline barcodes of the pool
+    template<int PLACE, bool EDIT>
+    long demuxPooled(SimpleRead* r);
+    long demuxDualIndex(SimpleRead* r);
+    template<int PLACE>
+    long demuxWhitelist(SimpleRead* r);
+
+    // the sample of the nearest inline barcode in the groups, or DEMUX_UNDETERMINED
+    template<bool EDIT>
+    inline int matchInline(SimpleRead* r, vector<InlineBarcodeGroup>& groups);
+    // the id of the index barcode in mIndex1, or -1
+    template<int PLACE>
+    inline int matchIndex(SimpleRead* r);
+    // copy the UMI segments of the read(s) to both mates
+    void extractUmi(SimpleRead* r1, SimpleRead* r2);
+    // locate the barcode of a read, a dual index barcode has two parts, otherwise len2 is 0
+    template<int PLACE>
+    inline bool locateBarcode(SimpleRead* r, const char*& data1, size_t& len1, const char*& data2, size_t& len2);
+
 private:
     Options* mOptions;
-    int* mHashTable;
-    map<long, int> mIndexSample;
-    unsigned int mHashTableLen;
+    // index1, or the whole barcode if index2 is not matched independently
+    BarcodeIndex* mIndex1;
+    // index2, only for independent dual index matching
+    BarcodeIndex* mIndex2;
+    // the whitelist maps a barcode to a sample directly, only for whitelist match mode
+    WhitelistIndex* mWhitelist;
+    // the mapped prebuilt index file
+    MappedFile* mPrebuilt;
+    // the inline barcode groups if barcode place is read1/read2
+    vector<InlineBarcodeGroup> mInlineGroups;
+    // the inline barcode groups of each pool in mIndex1, only for hierarchical demultiplexing
+    vector<vector<InlineBarcodeGroup> > mPoolGroups;
+    // the output of each barcode in mIndex1
+    vector<int> mBarcodeSample;
+    // the (index1, index2) pairs in the sample sheet, sorted by pairKey(id1, id2), and the output of each pair
+    // a full id1 x id2 table would be quadratic in the sample sheet size
+    vector<uint64> mPairKeys;
+    vector<int> mPairSample;
+    bool mDualIndex;
+    int mLane;
+    // the demuxer of each lane for a sample sheet with lanes, indexed by the lane number
+    vector<Demuxer*> mLaneDemuxers;
+    // the demuxer for the lanes not in the sample sheet
+    Demuxer* mOtherLanes;
+    // the reads of each hopped (index1, index2) pair merged from the demuxer threads
+    map<pair<string, string>, long> mHoppedPairs;
+    mutex mHoppedPairsLock;
+    // the cache key has the index in the read name
+    bool mCacheKeyIndex;
+    // the cache key has the bases in [mCacheKeyStart, mCacheKeyEnd) of the read, where the inline barcodes are searched
+    int mCacheKeyStart;
+    int mCacheKeyEnd;
+    // the selected kernels
+    int (Demuxer::*mSingleEndKernel)(SimpleRead*, DemuxerContext*);
+    int (Demuxer::*mPairedEndKernel)(SimpleRead*, SimpleRead*, DemuxerContext*);
 };
 
-#endif
\ No newline at end of file
+#endif
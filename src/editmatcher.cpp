@@ -0,0 +1,189 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "editmatcher.h"
+#include "util.h"
+
+inline static int baseCode(char base) {
+    switch(base) {
+        case 'A': return 0;
+        case 'T': return 1;
+        case 'C': return 2;
+        case 'G': return 3;
+        default: return -1;
+    }
+}
+
+EditMatcher::EditMatcher(int mismatch){
+    mMismatch = mismatch;
+}
+
+void EditMatcher::addBarcode(const string& barcode, int id) {
+    int len = barcode.length();
+    if(len == 0 || len > EDIT_MAX_LEN)
+        error_exit("Barcode length should be 1 ~ " + to_string(EDIT_MAX_LEN) + " for edit match mode: " + barcode);
+    uint64 peq[4] = {0, 0, 0, 0};
+    uint64 peqReversed[4] = {0, 0, 0, 0};
+    for(int p=0; p<len; p++) {
+        int b = baseCode(barcode[p]);
+        if(b < 0)
+            error_exit("Barcode can only contain A/T/C/G: " + barcode);
+        peq[b] |= 0x01UL << p;
+        peqReversed[b] |= 0x01UL << (len - 1 - p);
+    }
+    for(int b=0; b<4; b++) {
+        mPeq.push_back(peq[b]);
+        mPeqReversed.push_back(peqReversed[b]);
+    }
+    mLengths.push_back(len);
+    mIds.push_back(id);
+}
+
+// Myers' algorithm, the score is the distance of the pattern to the best substring ending at the current text position
+// carry is the horizontal delta of row 0: 0 lets the substring start anywhere (row 0 is all 0),
+// 1 anchors it at the first text position (row 0 is j)
+#define MYERS_STEP(eq, carry) \
+    { \
+        uint64 xv = eq | mv; \
+        uint64 xh = (((eq & pv) + pv) ^ pv) | eq; \
+        uint64 ph = mv | ~(xh | pv); \
+        uint64 mh = pv & xh; \
+        if(ph & high) \
+            score++; \
+        else if(mh & high) \
+            score--; \
+        ph = (ph << 1) | carry; \
+        mh <<= 1; \
+        pv = mh | ~(xv | ph); \
+        mv = ph & xv; \
+    }
+
+int EditMatcher::searchEnd(int i, const char* window, int windowLen, int expectedEnd, int& end) {
+    const uint64* peq = &mPeq[i * 4];
+    int len = mLengths[i];
+    uint64 high = 0x01UL << (len - 1);
+    uint64 pv = ~0UL;
+    uint64 mv = 0;
+    int score = len;
+    int best = len + 1;
+    end = -1;
+    for(int j=0; j<windowLen; j++) {
+        int b = baseCode(window[j]);
+        uint64 eq = b < 0 ? 0 : peq[b];
+        MYERS_STEP(eq, 0);
+        if(score < best || (score == best && abs(j - expectedEnd) < abs(end - expectedEnd))) {
+            best = score;
+            end = j;
+        }
+    }
+    return best;
+}
+
+int EditMatcher::searchStart(int i, const char* window, int end, int expectedStart) {
+    const uint64* peq = &mPeqReversed[i * 4];
+    int len = mLengths[i];
+    uint64 high = 0x01UL << (len - 1);
+    uint64 pv = ~0UL;
+    uint64 mv = 0;
+    int score = len;
+    int best = len + 1;
+    int start = end;
+    for(int j=end; j>=0; j--) {
+        int b = baseCode(window[j]);
+        uint64 eq = b < 0 ? 0 : peq[b];
+        MYERS_STEP(eq, 1);
+        if(score < best || (score == best && abs(j - expectedStart) < abs(start - expectedStart))) {
+            best = score;
+            start = j;
+        }
+    }
+    return start;
+}
+
+int EditMatcher::match(const char* window, int windowLen, int expectedStart, int& dist, int& spanStart, int& spanLen) {
+    int best = -1;
+    int bestDist = mMismatch + 1;
+    int bestEnd = 0;
+    bool tie = false;
+    for(int i=0; i<mIds.size(); i++) {
+        int end = 0;
+        int d = searchEnd(i, window, windowLen, expectedStart + mLengths[i] - 1, end);
+        if(d < bestDist) {
+            best = i;
+            bestDist = d;
+            bestEnd = end;
+            tie = false;
+        } else if(d == bestDist && best >= 0 && mIds[i] != mIds[best]) {
+            tie = true;
+        }
+    }
+    if(best < 0 || tie)
+        return -1;
+    dist = bestDist;
+    spanStart = searchStart(best, window, bestEnd, expectedStart);
+    spanLen = bestEnd - spanStart + 1;
+    return mIds[best];
+}
+
+bool EditMatcher::test() {
+    EditMatcher matcher(1);
+    matcher.addBarcode("AGTCAGAA", 0);
+    matcher.addBarcode("CCGTTACG", 1);
+    int dist = -1;
+    int start = -1;
+    int len = -1;
+    // exact, the window has 1 base before and after the barcode
+    if(matcher.match("TCCGTTACGT", 10, 1, dist, start, len) != 1 || dist != 0 || start != 1 || len != 8)
+        return false;
+    // a deletion in the barcode
+    if(matcher.match("TCCGTACGTT", 10, 1, dist, start, len) != 1 || dist != 1 || start != 1 || len != 7)
+        return false;
+    // an insertion in the barcode
+    if(matcher.match("TCCGTTTACGT", 11, 1, dist, start, len) != 1 || dist != 1 || start != 1 || len != 9)
+        return false;
+    // shifted by an insertion before the barcode
+    if(matcher.match("TTAGTCAGAAG", 11, 1, dist, start, len) != 0 || dist != 0 || start != 2 || len != 8)
+        return false;
+    // a substitution and an N
+    if(matcher.match("TCCGTNACGT", 10, 1, dist, start, len) != 1 || dist != 1)
+        return false;
+    // too far
+    if(matcher.match("TCCTTTTCGT", 10, 1, dist, start, len) != -1)
+        return false;
+    // the span must end at the matched end and have the reported distance, even if a start nearer to expectedStart
+    // has a same distance to a substring ending elsewhere
+    EditMatcher shortMatcher(1);
+    shortMatcher.addBarcode("CAC", 0);
+    // CA (deletion), not CCA which has distance 2
+    if(shortMatcher.match("GGCCATC", 7, 2, dist, start, len) != 0 || dist != 1 || start != 3 || len != 2)
+        return false;
+    EditMatcher tieMatcher(1);
+    tieMatcher.addBarcode("GCA", 0);
+    // GGA (substitution) and GA (deletion) both end at 3, the nearer start to expectedStart wins
+    if(tieMatcher.match("GGGAGGC", 7, 0, dist, start, len) != 0 || dist != 1 || start != 1 || len != 3)
+        return false;
+    if(tieMatcher.match("GGGAGGC", 7, 2, dist, start, len) != 0 || dist != 1 || start != 2 || len != 2)
+        return false;
+    return true;
+}
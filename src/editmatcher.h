@@ -0,0 +1,71 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef EDIT_MATCHER_H
+#define EDIT_MATCHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+using namespace std;
+
+// a barcode can be aligned by edit distance only if it fits in one 64-bit word
+const int EDIT_MAX_LEN = 64;
+
+// Match a barcode with insertions/deletions by the edit distance (Levenshtein distance).
+// The barcode can start anywhere in a small window around its expected place, so that a read with a 1-base
+// insertion or deletion before or inside the barcode can still be demultiplexed.
+// Myers' bit-parallel algorithm computes the distances of one candidate to all the window positions
+// with a few word operations per base. A base other than A/T/C/G is a mismatch to every candidate.
+class EditMatcher{
+public:
+    EditMatcher(int mismatch);
+    void addBarcode(const string& barcode, int id);
+    // search the window for the unique nearest candidate within the mismatch budget, return its id or -1
+    // expectedStart is where the barcode should be in the window, it decides the span if several spans have a same distance
+    // the distance is stored in dist, and the matched span of the window is stored in spanStart and spanLen
+    int match(const char* window, int windowLen, int expectedStart, int& dist, int& spanStart, int& spanLen);
+    int size() {return mIds.size();}
+
+    static bool test();
+
+private:
+    // the min distance of candidate i to a substring of the window, and where the substring ends (inclusive)
+    int searchEnd(int i, const char* window, int windowLen, int expectedEnd, int& end);
+    // the start of the substring ending exactly at end with the min distance, the reversed candidate is aligned backwards from end
+    int searchStart(int i, const char* window, int end, int expectedStart);
+
+private:
+    int mMismatch;
+    // mPeq[i * 4 + b] has the bits of the positions of base b in candidate i, mPeqReversed is for the reversed candidate
+    vector<uint64> mPeq;
+    vector<uint64> mPeqReversed;
+    vector<int> mLengths;
+    vector<int> mIds;
+};
+
+#endif
@@ -24,7 +24,11 @@ SOFTWARE.
 
 #include "evaluator.h"
 #include "fastqreader.h"
+#include "barcodetable.h"
+#include "sequence.h"
 #include <memory.h>
+#include <algorithm>
+#include <sstream>
 
 Evaluator::Evaluator(Options* opt){
     mOptions = opt;
@@ -76,3 +80,252 @@ int Evaluator::computeSeqLen(string filename, int& dataLen) {
         return 0;
     }
 }
+
+// a candidate place of the barcodes and its hits in the sampled reads
+struct PlaceCandidate {
+    int place;
+    int start;
+    int length;
+    bool reverseComplement;
+    long hits;
+};
+
+static string placeName(int place) {
+    switch(place) {
+        case BARCODE_AT_READ1: return "read1";
+        case BARCODE_AT_READ2: return "read2";
+        case BARCODE_AT_INDEX1: return "index1";
+        case BARCODE_AT_INDEX2: return "index2";
+        case BARCODE_AT_BOTH_INDEX: return "both_index";
+        default: return "unknown";
+    }
+}
+
+static string describe(const PlaceCandidate& c, long records) {
+    stringstream ss;
+    ss << placeName(c.place);
+    if(c.place == BARCODE_AT_READ1 || c.place == BARCODE_AT_READ2)
+        ss << ", start " << c.start + 1 << ", length " << c.length;
+    ss << (c.reverseComplement ? ", reverse complement" : ", forward");
+    ss << ": " << c.hits << " of " << records << " reads (" << c.hits * 100.0 / max(1L, records) << "%)";
+    return ss.str();
+}
+
+// the orientation (0 for forward, 1 for reverse complement) of an exactly matched barcode, or -1
+static int lookupOrientation(BarcodeTable<uint64>* table, const char* data, int len) {
+    if(table == NULL || len > BarcodeTable<uint64>::MAX_LEN)
+        return -1;
+    uint64 key = 0;
+    if(!BarcodeTable<uint64>::encode(data, len, key))
+        return -1;
+    int value = table->lookup(key);
+    if(value < 0 || (value >> BARCODE_DIST_BITS) == BARCODE_ID_AMBIGUOUS)
+        return -1;
+    return value >> BARCODE_DIST_BITS;
+}
+
+void Evaluator::detectBarcodePlace() {
+    vector<Sample>& samples = mOptions->samples;
+    bool hasIndex2 = true;
+    vector<int> lengths;
+    for(int i=0; i<samples.size(); i++) {
+        if(samples[i].index2.empty())
+            hasIndex2 = false;
+        int len = samples[i].index1.length();
+        if(len > BarcodeTable<uint64>::MAX_LEN)
+            error_exit("Cannot detect the place of barcodes longer than " + to_string(BarcodeTable<uint64>::MAX_LEN) + "bp, please specify it by -b or --barcode_place");
+        if(find(lengths.begin(), lengths.end(), len) == lengths.end())
+            lengths.push_back(len);
+    }
+
+    // the barcodes in both orientations, the id is the orientation
+    BarcodeTable<uint64> table1(samples.size() * 2, 0);
+    BarcodeTable<uint64>* table2 = NULL;
+    if(hasIndex2)
+        table2 = new BarcodeTable<uint64>(samples.size() * 2, 0);
+    for(int i=0; i<samples.size(); i++) {
+        table1.addBarcode(samples[i].index1, 0);
+        table1.addBarcode(Sequence(samples[i].index1).reverseComplement().mStr, 1);
+        if(table2) {
+            table2->addBarcode(samples[i].index2, 0);
+            table2->addBarcode(Sequence(samples[i].index2).reverseComplement().mStr, 1);
+        }
+    }
+
+    int readNum = mOptions->in2.empty() ? 1 : 2;
+    int lengthNum = lengths.size();
+    // inlineHits[((read * 2 + orientation) * lengthNum + l) * (DETECT_MAX_OFFSET + 1) + offset]
+    vector<long> inlineHits(readNum * 2 * lengthNum * (DETECT_MAX_OFFSET + 1), 0);
+    long index1Hits[2] = {0, 0};
+    long index2Hits[2] = {0, 0};
+    long bothHits[2] = {0, 0};
+
+    FastqReader reader1(mOptions->in1);
+    FastqReader* reader2 = NULL;
+    if(readNum == 2)
+        reader2 = new FastqReader(mOptions->in2);
+    long records = 0;
+    while(records < DETECT_READS) {
+        SimpleRead* reads[2] = {reader1.read(), reader2 ? reader2->read() : NULL};
+        if(reads[0] == NULL || (reader2 && reads[1] == NULL)) {
+            if(reads[0]) delete reads[0];
+            if(reads[1]) delete reads[1];
+            break;
+        }
+        records++;
+
+        for(int r=0; r<readNum; r++) {
+            const char* seq = reads[r]->data() + reads[r]->seqStart();
+            for(int l=0; l<lengthNum; l++) {
+                int len = lengths[l];
+                int end = min((int)reads[r]->seqLen(), DETECT_MAX_OFFSET + len);
+                for(int offset=0; offset + len <= end; offset++) {
+                    int orientation = lookupOrientation(&table1, seq + offset, len);
+                    if(orientation >= 0)
+                        inlineHits[((r * 2 + orientation) * lengthNum + l) * (DETECT_MAX_OFFSET + 1) + offset]++;
+                }
+            }
+        }
+
+        unsigned int s1, l1, s2, l2;
+        const char* data = reads[0]->data();
+        if(reads[0]->getIlluminaBothIndexPlaces(s1, l1, s2, l2)) {
+            int o1 = lookupOrientation(&table1, data + s1, l1);
+            if(o1 >= 0)
+                index1Hits[o1]++;
+            if(table2) {
+                // i5 can be in a different orientation, it is detected later by detectIndexOrientation()
+                int o2 = lookupOrientation(table2, data + s2, l2);
+                if(o1 >= 0 && o2 >= 0)
+                    bothHits[o1]++;
+            } else {
+                int o2 = lookupOrientation(&table1, data + s2, l2);
+                if(o2 >= 0)
+                    index2Hits[o2]++;
+            }
+        } else if(reads[0]->getIlluminaIndex1Place(s1, l1)) {
+            int o1 = lookupOrientation(&table1, data + s1, l1);
+            if(o1 >= 0)
+                index1Hits[o1]++;
+        }
+
+        delete reads[0];
+        if(reads[1])
+            delete reads[1];
+    }
+    if(reader2)
+        delete reader2;
+    if(table2)
+        delete table2;
+
+    vector<PlaceCandidate> candidates;
+    for(int orientation=0; orientation<2; orientation++) {
+        for(int r=0; r<readNum; r++) {
+            for(int l=0; l<lengthNum; l++) {
+                for(int offset=0; offset<=DETECT_MAX_OFFSET; offset++) {
+                    long hits = inlineHits[((r * 2 + orientation) * lengthNum + l) * (DETECT_MAX_OFFSET + 1) + offset];
+                    if(hits > 0) {
+                        PlaceCandidate c = {r == 0 ? BARCODE_AT_READ1 : BARCODE_AT_READ2, offset, lengths[l], orientation == 1, hits};
+                        candidates.push_back(c);
+                    }
+                }
+            }
+        }
+        // a dual index sheet prefers both_index, since both indexes are checked
+        PlaceCandidate both = {BARCODE_AT_BOTH_INDEX, 0, 0, orientation == 1, bothHits[orientation]};
+        PlaceCandidate index1 = {BARCODE_AT_INDEX1, 0, 0, orientation == 1, index1Hits[orientation]};
+        PlaceCandidate index2 = {BARCODE_AT_INDEX2, 0, 0, orientation == 1, index2Hits[orientation]};
+        if(hasIndex2 && both.hits > 0)
+            candidates.push_back(both);
+        else if(index1.hits > 0)
+            candidates.push_back(index1);
+        if(index2.hits > 0)
+            candidates.push_back(index2);
+    }
+
+    int best = -1;
+    for(int i=0; i<candidates.size(); i++) {
+        if(best < 0 || candidates[i].hits > candidates[best].hits)
+            best = i;
+    }
+    for(int i=0; i<candidates.size(); i++) {
+        if(candidates[i].hits * 10 >= candidates[best].hits)
+            mOptions->log("barcode place candidate: " + describe(candidates[i], records));
+    }
+    if(best < 0 || candidates[best].hits < records * DETECT_MIN_RATIO)
+        error_exit("Failed to detect the place of barcodes from " + to_string(records) + " reads, please check the sample sheet or specify the place by -b or --barcode_place");
+
+    PlaceCandidate& c = candidates[best];
+    cerr << "detected barcode place: " << describe(c, records) << endl;
+    mOptions->barcodePlace = c.place;
+    if(c.place == BARCODE_AT_READ1 || c.place == BARCODE_AT_READ2) {
+        mOptions->barcodeStart = c.start;
+        // the inline barcodes have no index2
+        for(int i=0; i<samples.size(); i++)
+            samples[i].index2 = "";
+    }
+    if(c.reverseComplement) {
+        mOptions->indexReverseComplement = !mOptions->indexReverseComplement;
+        for(int i=0; i<samples.size(); i++) {
+            samples[i].index1 = Sequence(samples[i].index1).reverseComplement().mStr;
+            if(!samples[i].index2.empty())
+                samples[i].index2 = Sequence(samples[i].index2).reverseComplement().mStr;
+        }
+    }
+}
+
+void Evaluator::detectIndexOrientation() {
+    vector<Sample>& samples = mOptions->samples;
+    for(int i=0; i<samples.size(); i++) {
+        if(samples[i].index1.length() > BarcodeTable<uint64>::MAX_LEN || samples[i].index2.length() > BarcodeTable<uint64>::MAX_LEN)
+            return;
+    }
+
+    // i7 and i5 in both orientations, the id is the orientation
+    BarcodeTable<uint64> table1(samples.size() * 2, 0);
+    BarcodeTable<uint64> table2(samples.size() * 2, 0);
+    for(int i=0; i<samples.size(); i++) {
+        table1.addBarcode(samples[i].index1, 0);
+        table1.addBarcode(Sequence(samples[i].index1).reverseComplement().mStr, 1);
+        table2.addBarcode(samples[i].index2, 0);
+        table2.addBarcode(Sequence(samples[i].index2).reverseComplement().mStr, 1);
+    }
+
+    long hits1[2] = {0, 0};
+    long hits2[2] = {0, 0};
+    FastqReader reader(mOptions->in1);
+    long records = 0;
+    while(records < DETECT_ORIENTATION_READS) {
+        SimpleRead* r = reader.read();
+        if(r == NULL)
+            break;
+        records++;
+        unsigned int s1, l1, s2, l2;
+        if(r->getIlluminaBothIndexPlaces(s1, l1, s2, l2)) {
+            int o1 = lookupOrientation(&table1, r->data() + s1, l1);
+            if(o1 >= 0)
+                hits1[o1]++;
+            int o2 = lookupOrientation(&table2, r->data() + s2, l2);
+            if(o2 >= 0)
+                hits2[o2]++;
+        }
+        delete r;
+    }
+
+    const char* names[2] = {"i7 (index1)", "i5 (index2)"};
+    long* hits[2] = {hits1, hits2};
+    for(int index=0; index<2; index++) {
+        long forward = hits[index][0];
+        long reverse = hits[index][1];
+        mOptions->log(string(names[index]) + " orientation: forward " + to_string(forward) + ", reverse complement " + to_string(reverse) + " of " + to_string(records) + " reads");
+        // only flip an index if the reverse complement clearly matches
+        if(reverse <= forward || reverse < records * DETECT_MIN_RATIO)
+            continue;
+        cerr << "detected " << names[index] << " orientation: reverse complement of the sample sheet, "
+            << reverse << " vs " << forward << " of " << records << " reads are matched" << endl;
+        for(int i=0; i<samples.size(); i++) {
+            string& barcode = index == 0 ? samples[i].index1 : samples[i].index2;
+            barcode = Sequence(barcode).reverseComplement().mStr;
+        }
+    }
+}
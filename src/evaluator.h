@@ -33,12 +33,28 @@ SOFTWARE.
 
 using namespace std;
 
+// the number of reads sampled to detect the barcode place
+const long DETECT_READS = 1000000;
+// the inline barcodes are searched in the first bases of read1/read2
+const int DETECT_MAX_OFFSET = 64;
+// the detected place should match at least this ratio of the sampled reads
+const double DETECT_MIN_RATIO = 0.05;
+// the number of reads sampled to detect the orientation of i7/i5
+const long DETECT_ORIENTATION_READS = 100000;
+
 class Evaluator{
 public:
     Evaluator(Options* opt);
     ~Evaluator();
     void evaluateSeqLen();
     int computeSeqLen(string filename, int& dataLen);
+    // find where the barcodes of the sample sheet are by exact matching a sample of reads:
+    // every offset of read1/read2, and the index1/index2 in the read names, in both orientations.
+    // the best place is applied to the options
+    void detectBarcodePlace();
+    // for a dual index sample sheet, check i7 and i5 independently against the sampled reads,
+    // and reverse complement an index of the samples if its reverse complement matches more reads
+    void detectIndexOrientation();
 private:
     Options* mOptions;
 
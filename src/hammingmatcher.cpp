@@ -0,0 +1,347 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "hammingmatcher.h"
+#include "util.h"
+#include <math.h>
+#include <thread>
+
+// the lower bit of each 2-bit base
+const uint64 HAMMING_LOW_BITS = 0x5555555555555555UL;
+
+// count the bits of a mask that only has bits on the lower bit of each 2-bit base
+// only shifts, adds and ands are used, so it can be vectorized without popcnt instruction
+inline static uint64 popcount2bit(uint64 x) {
+    x = (x & 0x3333333333333333UL) + ((x >> 2) & 0x3333333333333333UL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+    x = x + (x >> 8);
+    x = x + (x >> 16);
+    x = x + (x >> 32);
+    return x & 0x7f;
+}
+
+HammingMatcher::HammingMatcher(int mismatch){
+    mMismatch = mismatch;
+    mLength = 0;
+    mWords = 0;
+    mMinPosterior = 0.99;
+    for(int q=0; q<94; q++) {
+        // a base with error rate 0.75 tells nothing
+        double e = min(0.75, pow(10.0, -q/10.0));
+        mMismatchPenalty[q] = log(1.0 - e) - log(e / 3.0);
+        mBackgroundScore[q] = log(0.25) - log(1.0 - e);
+    }
+}
+
+HammingMatcher::~HammingMatcher() {
+}
+
+void HammingMatcher::addBarcode(const string& barcode, int id) {
+    if(barcode.length() > HAMMING_MAX_LEN)
+        error_exit("Barcode length should be <= " + to_string(HAMMING_MAX_LEN) + "bp: " + barcode);
+    if(mIds.empty()) {
+        mLength = barcode.length();
+        mWords = (mLength + 31) / 32;
+    } else if(barcode.length() != mLength) {
+        error_exit("All barcodes should have a same length for Hamming matching: " + barcode);
+    }
+
+    uint64 codes[HAMMING_MAX_WORDS];
+    uint64 nmasks[HAMMING_MAX_WORDS];
+    if(encode(barcode.c_str(), barcode.length(), codes, nmasks) > 0)
+        error_exit("Barcode can only contain A/T/C/G: " + barcode);
+
+    for(int w=0; w<mWords; w++)
+        mCodes[w].push_back(codes[w]);
+    mIds.push_back(id);
+}
+
+int HammingMatcher::encode(const char* data, size_t len, uint64* codes, uint64* nmasks) {
+    int nCount = 0;
+    for(int w=0; w<mWords; w++) {
+        codes[w] = 0;
+        nmasks[w] = 0;
+    }
+    for(int i=0; i<len; i++) {
+        uint64 val = 0;
+        switch(data[i]) {
+            case 'A': val = 0; break;
+            case 'T': val = 1; break;
+            case 'C': val = 2; break;
+            case 'G': val = 3; break;
+            default:
+                nmasks[i>>5] |= (0x01UL << ((i & 0x1F) << 1));
+                nCount++;
+        }
+        codes[i>>5] |= (val << ((i & 0x1F) << 1));
+    }
+    return nCount;
+}
+
+void HammingMatcher::computeDistances(const uint64* codes, const uint64* nmasks, int nCount, int start, int num, uint32* dist) {
+    for(int i=0; i<num; i++)
+        dist[i] = nCount;
+    for(int w=0; w<mWords; w++) {
+        const uint64* candidates = mCodes[w].data() + start;
+        const uint64 code = codes[w];
+        // the N bases have been counted already
+        const uint64 keep = HAMMING_LOW_BITS & ~nmasks[w];
+        for(int i=0; i<num; i++) {
+            uint64 x = candidates[i] ^ code;
+            x = (x | (x >> 1)) & keep;
+            dist[i] += popcount2bit(x);
+        }
+    }
+}
+
+void HammingMatcher::nearestDistances(vector<int>& nearest, int threadNum) {
+    int num = mIds.size();
+    nearest.assign(num, HAMMING_MAX_LEN + 1);
+    threadNum = max(1, min(threadNum, num / HAMMING_BLOCK_SIZE));
+    if(threadNum == 1) {
+        computeNearest(0, num, &nearest);
+        return;
+    }
+    vector<thread> threads;
+    for(int t=0; t<threadNum; t++)
+        threads.push_back(thread(&HammingMatcher::computeNearest, this, (long)num * t / threadNum, (long)num * (t + 1) / threadNum, &nearest));
+    for(int t=0; t<threadNum; t++)
+        threads[t].join();
+}
+
+void HammingMatcher::computeNearest(int from, int to, vector<int>* nearest) {
+    int num = mIds.size();
+    uint64 codes[HAMMING_MAX_WORDS];
+    uint64 nmasks[HAMMING_MAX_WORDS] = {0};
+    uint32 dist[HAMMING_BLOCK_SIZE];
+    for(int i=from; i<to; i++) {
+        for(int w=0; w<mWords; w++)
+            codes[w] = mCodes[w][i];
+        int best = HAMMING_MAX_LEN + 1;
+        for(int start=0; start<num; start+=HAMMING_BLOCK_SIZE) {
+            int blockSize = min(HAMMING_BLOCK_SIZE, num - start);
+            computeDistances(codes, nmasks, 0, start, blockSize, dist);
+            for(int k=0; k<blockSize; k++) {
+                if(start + k != i && dist[k] < best)
+                    best = dist[k];
+            }
+        }
+        (*nearest)[i] = best;
+    }
+}
+
+void HammingMatcher::computeMasks(const uint64* codes, const uint64* nmasks, int start, int num, uint64 masks[][HAMMING_BLOCK_SIZE]) {
+    for(int w=0; w<mWords; w++) {
+        const uint64* candidates = mCodes[w].data() + start;
+        const uint64 code = codes[w];
+        const uint64 keep = HAMMING_LOW_BITS & ~nmasks[w];
+        uint64* m = masks[w];
+        for(int i=0; i<num; i++) {
+            uint64 x = candidates[i] ^ code;
+            m[i] = (x | (x >> 1)) & keep;
+        }
+    }
+}
+
+int HammingMatcher::matchWithQuality(const char* data, const char* qual, size_t len, int& dist, double& posterior) {
+    if(len != mLength || mIds.empty())
+        return -1;
+
+    uint64 codes[HAMMING_MAX_WORDS];
+    uint64 nmasks[HAMMING_MAX_WORDS];
+    int nCount = encode(data, len, codes, nmasks);
+    if(nCount > mMismatch)
+        return -1;
+
+    // a N base has a same likelihood for all candidates, so it is not in the masks
+    float penalty[HAMMING_MAX_LEN];
+    // the score of a barcode not in the candidates, any base of it is equally likely
+    float backgroundScore = 0;
+    for(int p=0; p<len; p++) {
+        int q = qual[p] - 33;
+        if(q < 0)
+            q = 0;
+        if(q > 93)
+            q = 93;
+        penalty[p] = mMismatchPenalty[q];
+        if(data[p] == 'A' || data[p] == 'T' || data[p] == 'C' || data[p] == 'G')
+            backgroundScore += mBackgroundScore[q];
+    }
+
+    uint64 masks[HAMMING_MAX_WORDS][HAMMING_BLOCK_SIZE];
+    float scores[HAMMING_BLOCK_SIZE];
+    int total = mIds.size();
+    // log-sum-exp of all the scores relative to the best score
+    float bestScore = 0;
+    double sum = 0;
+    int bestIdx = -1;
+    int bestDist = 0;
+    bool tie = false;
+    for(int start=0; start<total; start += HAMMING_BLOCK_SIZE) {
+        int num = min(HAMMING_BLOCK_SIZE, total - start);
+        computeMasks(codes, nmasks, start, num, masks);
+        for(int i=0; i<num; i++)
+            scores[i] = 0;
+        // position by position, so that the inner loop over the candidates can be vectorized
+        for(int p=0; p<len; p++) {
+            const uint64* m = masks[p>>5];
+            const int shift = (p & 0x1F) << 1;
+            const float pen = penalty[p];
+            for(int i=0; i<num; i++)
+                scores[i] -= pen * (float)((m[i] >> shift) & 0x01);
+        }
+        for(int i=0; i<num; i++) {
+            if(bestIdx < 0 || scores[i] > bestScore) {
+                if(bestIdx >= 0)
+                    sum = sum * exp(bestScore - scores[i]);
+                sum += 1.0;
+                bestScore = scores[i];
+                bestIdx = start + i;
+                tie = false;
+                bestDist = nCount;
+                for(int w=0; w<mWords; w++)
+                    bestDist += popcount2bit(masks[w][i]);
+            } else {
+                if(scores[i] == bestScore)
+                    tie = true;
+                sum += exp(scores[i] - bestScore);
+            }
+        }
+    }
+
+    if(bestIdx < 0 || tie || bestDist > mMismatch)
+        return -1;
+    // the reads of the unlisted barcodes (adapter dimers, PhiX...) share a prior with the candidates,
+    // so that a read far from all the candidates is not assigned to the nearest one
+    double unlistedWeight = QUALITY_UNLISTED_PRIOR * total / (1.0 - QUALITY_UNLISTED_PRIOR);
+    sum += unlistedWeight * exp(backgroundScore - bestScore);
+    posterior = 1.0 / sum;
+    if(posterior < mMinPosterior)
+        return -1;
+    dist = bestDist;
+    return mIds[bestIdx];
+}
+
+int HammingMatcher::match(const char* data, size_t len, int& dist) {
+    if(len != mLength || mIds.empty())
+        return -1;
+
+    uint64 codes[HAMMING_MAX_WORDS];
+    uint64 nmasks[HAMMING_MAX_WORDS];
+    int nCount = encode(data, len, codes, nmasks);
+    if(nCount > mMismatch)
+        return -1;
+
+    uint32 d[HAMMING_BLOCK_SIZE];
+    int total = mIds.size();
+    uint32 best = mMismatch + 1;
+    int bestIdx = -1;
+    bool tie = false;
+    for(int start=0; start<total; start += HAMMING_BLOCK_SIZE) {
+        int num = min(HAMMING_BLOCK_SIZE, total - start);
+        computeDistances(codes, nmasks, nCount, start, num, d);
+        for(int i=0; i<num; i++) {
+            if(d[i] < best) {
+                best = d[i];
+                bestIdx = start + i;
+                tie = false;
+            } else if(d[i] == best) {
+                tie = true;
+            }
+        }
+    }
+
+    if(bestIdx < 0 || tie)
+        return -1;
+    dist = best;
+    return mIds[bestIdx];
+}
+
+bool HammingMatcher::test() {
+    HammingMatcher m(2);
+    m.addBarcode("AGTCAGAA", 0);
+    m.addBarcode("CCGTTACG", 1);
+    m.addBarcode("AGTCAGTT", 2);
+
+    int dist = -1;
+    if(m.match("CCGTTACG", 8, dist) != 1 || dist != 0)
+        return false;
+    if(m.match("CCGTAACG", 8, dist) != 1 || dist != 1)
+        return false;
+    if(m.match("CCNTAACG", 8, dist) != 1 || dist != 2)
+        return false;
+    // too many mismatches
+    if(m.match("CCNTAACC", 8, dist) != -1)
+        return false;
+    // AGTCAGAT is 1 mismatch to both AGTCAGAA and AGTCAGTT
+    if(m.match("AGTCAGAT", 8, dist) != -1)
+        return false;
+    // wrong length
+    if(m.match("CCGTTACGA", 9, dist) != -1)
+        return false;
+
+    // a barcode longer than one word
+    HammingMatcher m2(3);
+    string s1("AGTCAGAATTCGGATCCAAGTCAGAATTCGGATCCAA");
+    string s2("TTTCAGAATTCGGATCCAAGTCAGAATTCGGATCCAA");
+    m2.addBarcode(s1, 5);
+    m2.addBarcode(s2, 6);
+    string r = s1;
+    r[36] = 'N';
+    r[33] = 'G';
+    if(m2.match(r.c_str(), r.length(), dist) != 5 || dist != 2)
+        return false;
+
+    // quality aware matching
+    HammingMatcher m3(2);
+    m3.addBarcode("AGTCAGAA", 0);
+    m3.addBarcode("AGTCAGTT", 1);
+    double posterior = 0;
+    // 1 mismatch to both, but the mismatch to AGTCAGAA is a low quality base
+    if(m3.matchWithQuality("AGTCAGAT", "FFFFFFF#", 8, dist, posterior) != 0 || dist != 1 || posterior < 0.99)
+        return false;
+    if(m3.matchWithQuality("AGTCAGAT", "FFFFFF#F", 8, dist, posterior) != 1 || dist != 1)
+        return false;
+    // same qualities, cannot tell
+    if(m3.matchWithQuality("AGTCAGAT", "FFFFFFFF", 8, dist, posterior) != -1)
+        return false;
+    // exact match with high qualities
+    if(m3.matchWithQuality("AGTCAGAA", "FFFFFFFF", 8, dist, posterior) != 0 || dist != 0)
+        return false;
+    // exact match with low qualities is not confident enough
+    if(m3.matchWithQuality("AGTCAGAA", "FFFFFF##", 8, dist, posterior) != -1)
+        return false;
+
+    // without a mismatch cap, low quality mismatches are rescued by the posterior, high quality ones are not
+    HammingMatcher m4(HAMMING_MAX_LEN);
+    m4.addBarcode("AGTCAGAA", 0);
+    m4.addBarcode("CCGTTACG", 1);
+    m4.addBarcode("TTACGTCA", 2);
+    if(m4.matchWithQuality("AGTCTGAC", "FFFF#FF#", 8, dist, posterior) != 0 || dist != 2 || posterior < 0.99)
+        return false;
+    if(m4.matchWithQuality("AGTCTGAC", "FFFFFFFF", 8, dist, posterior) != -1)
+        return false;
+
+    return true;
+}
@@ -0,0 +1,92 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef HAMMING_MATCHER_H
+#define HAMMING_MATCHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+using namespace std;
+
+// at most 256bp (8 x 32 bases) for a barcode
+const int HAMMING_MAX_WORDS = 8;
+const int HAMMING_MAX_LEN = HAMMING_MAX_WORDS * 32;
+// the candidates are compared block by block
+const int HAMMING_BLOCK_SIZE = 64;
+// in quality-aware matching, the prior probability that a read has a barcode not in the candidates
+const double QUALITY_UNLISTED_PRIOR = 0.01;
+
+// Match a barcode to a set of candidates by Hamming distance without any precomputed mutant table.
+// The candidates are packed as 2-bit words and stored word by word (structure of arrays),
+// so that the XOR + popcount loop over all candidates can be vectorized by the compiler.
+// A base other than A/T/C/G is counted as a mismatch to every candidate.
+// matchWithQuality() scores the candidates by the likelihood of the bases given their Phred qualities,
+// and accepts the best one if its posterior probability reaches the threshold (similar to deML), the mismatch is only a cap.
+// The posterior also counts the chance that the barcode is none of the candidates.
+class HammingMatcher{
+public:
+    HammingMatcher(int mismatch);
+    ~HammingMatcher();
+    void addBarcode(const string& barcode, int id);
+    // return the id of the unique nearest candidate within the mismatch budget, or -1
+    // the distance is stored in dist, a tie of the nearest candidates returns -1
+    int match(const char* data, size_t len, int& dist);
+    // same as match(), but the nearest candidate is the one with the highest likelihood
+    // the posterior probability of it is stored in posterior
+    int matchWithQuality(const char* data, const char* qual, size_t len, int& dist, double& posterior);
+    void setMinPosterior(double p) {mMinPosterior = p;}
+    // the Hamming distance from each candidate to its nearest other candidate, in the adding order
+    // a candidate without any other candidate gets HAMMING_MAX_LEN + 1
+    void nearestDistances(vector<int>& nearest, int threadNum);
+    int length() {return mLength;}
+    int size() {return mIds.size();}
+
+    static bool test();
+
+private:
+    // encode the bases into 2-bit words, nmasks mark the bases that are not A/T/C/G
+    int encode(const char* data, size_t len, uint64* codes, uint64* nmasks);
+    void computeDistances(const uint64* codes, const uint64* nmasks, int nCount, int start, int num, uint32* dist);
+    void computeNearest(int from, int to, vector<int>* nearest);
+    void computeMasks(const uint64* codes, const uint64* nmasks, int start, int num, uint64 masks[][HAMMING_BLOCK_SIZE]);
+
+private:
+    int mMismatch;
+    int mLength;
+    int mWords;
+    // mCodes[w][i] is the w-th word of the i-th candidate
+    vector<uint64> mCodes[HAMMING_MAX_WORDS];
+    vector<int> mIds;
+    double mMinPosterior;
+    // the log-likelihood penalty of a mismatch for each Phred quality (0 ~ 93)
+    float mMismatchPenalty[94];
+    // the log-likelihood of a base of an unlisted barcode relative to a matched base, for each Phred quality
+    float mBackgroundScore[94];
+};
+
+#endif
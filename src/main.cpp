@@ -46,21 +46,40 @@ int main(int argc, char* argv[]){
         tester.run();
         return 0;
     }
+    if (argc == 2 && strcmp(argv[1], "benchmark")==0){
+        UnitTest tester;
+        tester.benchmark();
+        return 0;
+    }
     cmdline::parser cmd;
     // input/output
     cmd.add<string>("in1", '1', "input file name for read1", true, "");
     cmd.add<string>("in2", '2', "input file name for read2", false, "");
-    cmd.add<string>("barcode_place", 'b', "For MGI it should be read1 or read2, for Illumina, it should be index1/index2/both_index", true, "");
-    cmd.add<int>("barcode_start", 's', "If barcode_place is read1 or read2, the barcode starting position should be specified. This is 1-based.", false, 0);
-    cmd.add<int>("barcode_length", 'l', "If barcode_place is read1 or read2, the barcode length should be specified", false, 0);
+    cmd.add<string>("barcode_place", 'b', "For MGI it should be read1 or read2, for Illumina, it should be index1/index2/both_index. auto means detecting it from the first 1M reads", true, "");
+    cmd.add<int>("barcode_start", 's', "If barcode_place is read1 or read2, the barcode starting position should be specified, unless the index file gives a starting position for each sample in the third column (the fourth column for hierarchical demultiplexing). This is 1-based.", false, 0);
+    cmd.add<int>("barcode_length", 'l', "If barcode_place is read1 or read2 (or inline_place is specified), the barcode length. Default 0 means the length of each barcode in the index file.", false, 0);
     cmd.add<string>("index", 'i', "a CSV/TSV/FASTA file contains two values (filename, barcode)", true, "");
+    cmd.add("by_lane", 0, "the first column of the index file is the lane (1, 2..., or * for all lanes), the reads of each lane (in the Illumina read names) are only demultiplexed to the samples of this lane. The records with a same filename go to a same output.");
     cmd.add("reverse_complement", 'r', "specify this if the index barcodes are reverse complement.");
+    cmd.add("keep_orientation", 0, "for a dual index sample sheet, the orientations of i7 and i5 are detected from the first 100K reads by default. Specify this to use the sample sheet as it is.");
     cmd.add<string>("out_folder", 'o', "output folder, default is current working directory", false, ".");
     cmd.add<string>("undecoded", 'u', "the file name to store undetermined reads, default is 'undecoded'. To discard the undetermined reads, specify discard", false, "undecoded");
     cmd.add<int>("compression", 'z', "compression level for gzip output (1 ~ 12). 0 means no compression, 1 is fastest, 12 is smallest, default is 6. ", false, 6);
-    cmd.add<int>("allowed_mismatch", 'a', "allowed mismatch (0~2)", false, 0);
+    cmd.add<int>("allowed_mismatch", 'a', "allowed mismatch (0~2 for table match mode). In quality match mode it is only an optional cap, 0 means no cap", false, 0);
+    cmd.add<string>("inline_place", 0, "hierarchical demultiplexing: split the reads by the pool index at barcode_place (index1/index2/both_index), then by the inline barcode in read1 or read2. The index file contains (filename, pool index, inline barcode, [inline barcode start])", false, "");
+    cmd.add<int>("inline_mismatch", 0, "allowed mismatch of the inline barcodes for hierarchical demultiplexing, default -1 means same as allowed_mismatch", false, -1);
+    cmd.add<int>("allowed_mismatch2", 0, "allowed mismatch of index2 if barcode_place is both_index and the index file has index2, default -1 means same as allowed_mismatch", false, -1);
+    cmd.add("auto_mismatch", 0, "in table match mode, allow each barcode (nearest distance - 1) / 2 mismatches, so that no read is near to two barcodes. allowed_mismatch (or 2 if it is 0) is the upper limit. The minimum distances are printed.");
+    cmd.add<string>("match_mode", 0, "table: lookup in a precomputed mutant table (mismatch 0~2), hamming: compare to all barcodes by Hamming distance (any mismatch), quality: pick the most likely barcode by the base qualities, and accept it by its posterior probability (read1/read2 only), whitelist: a large barcode whitelist (<=32bp, mismatch 0~1), rows with a same file name go to a same output, edit: like hamming, but insertions/deletions are also counted as mismatches (read1/read2 only). Default is table.", false, "table");
+    cmd.add<string>("prebuilt_index", 0, "in table or whitelist match mode, load the prebuilt barcode index from this file, or build and save it here if it is missing or out of date.", false, "");
+    cmd.add<int>("max_shift", 0, "in edit match mode, the inline barcode can slide at most max_shift bases from barcode_start, default -1 means same as allowed_mismatch", false, -1);
+    cmd.add<double>("min_posterior", 0, "in quality match mode, a read is assigned to the most likely barcode if its posterior probability >= min_posterior however many mismatches it has (unless allowed_mismatch caps them), default 0.99", false, 0.99);
+    cmd.add<string>("umi", 0, "move the UMI segments (i.e. read1:1-8,read2:1-6, 1-based and inclusive) from the reads to the read names of both mates, the segments are joined by _", false, "");
+    cmd.add<string>("hopping_report", 0, "for dual index demultiplexing (both_index, and the index file has index2), write the reads of each unexpected (index1, index2) pair to this TSV file as an index1 x index2 matrix", false, "");
     cmd.add<int>("thread", 'n', "number of threads (at least 4 for SE, 5 for PE), default 0 means one thread per core.", false, 0);
+    cmd.add<int>("demux_thread", 0, "number of demuxer threads, default 0 means auto (one per 16 threads, at most 8).", false, 0);
     cmd.add<int>("memory", 'm', "memory limit (GB), 4GB is minimal, default 0 means unlimited.", false, 0);
+    cmd.add<int>("sample_buffer", 0, "the limit (MB) of the reads queued for each output file, the demuxers wait when it is full. Default 0 means the read buffer (half of memory, or 8GB) divided by the outputs.", false, 0);
     cmd.add("debug", 0, "print debug information.");
 
     cmd.parse_check(argc, argv);
@@ -88,7 +107,10 @@ int main(int argc, char* argv[]){
         opt.discardUndecoded = true;
     opt.compression = cmd.get<int>("compression");
     opt.threadNum = cmd.get<int>("thread");
+    opt.demuxerThreadNum = cmd.get<int>("demux_thread");
     opt.mismatch = cmd.get<int>("allowed_mismatch");
+    opt.mismatch2 = cmd.get<int>("allowed_mismatch2");
+    opt.autoMismatch = cmd.exist("auto_mismatch");
     int mem = cmd.get<int>("memory");
     if(mem>0) {
         if(mem<1)
@@ -96,8 +118,12 @@ int main(int argc, char* argv[]){
         else if(mem>10000)
             error_exit("memory limit cannot be larger than 10000GB, you specified " + to_string(mem) + " GB");
         else
-            opt.memoryLimitBytes = mem * 1024 * 1024 * 1024;
+            opt.memoryLimitBytes = (long)mem * 1024 * 1024 * 1024;
     }
+    int sampleBuffer = cmd.get<int>("sample_buffer");
+    if(sampleBuffer < 0)
+        error_exit("sample_buffer should be >= 0, you specified " + to_string(sampleBuffer));
+    opt.sampleBufferLimitBytes = (long)sampleBuffer * 1024 * 1024;
 
     string barcodePlace = cmd.get<string>("barcode_place");
     if(barcodePlace == "read1") 
@@ -110,15 +136,47 @@ int main(int argc, char* argv[]){
     	opt.barcodePlace = BARCODE_AT_INDEX2;
     else if(barcodePlace == "both_index") 
     	opt.barcodePlace = BARCODE_AT_BOTH_INDEX;
+    else if(barcodePlace == "auto") 
+    	opt.barcodePlace = BARCODE_AT_AUTO;
     else
-    	error_exit("Please specify barcode place correctly by -b or --barcode_place. For MGI it should be read1 or read2; for Illumina, it should be index1/index2/both_index");
-
-    if(barcodePlace == "read1" || barcodePlace == "read2") {
+    	error_exit("Please specify barcode place correctly by -b or --barcode_place. For MGI it should be read1 or read2; for Illumina, it should be index1/index2/both_index; or auto to detect it");
+
+    string inlinePlace = cmd.get<string>("inline_place");
+    if(inlinePlace == "read1")
+        opt.inlinePlace = BARCODE_AT_READ1;
+    else if(inlinePlace == "read2")
+        opt.inlinePlace = BARCODE_AT_READ2;
+    else if(!inlinePlace.empty())
+        error_exit("inline_place should be read1 or read2");
+    opt.inlineMismatch = cmd.get<int>("inline_mismatch");
+
+    if(barcodePlace == "read1" || barcodePlace == "read2" || !inlinePlace.empty()) {
     	// minus by one for 1-based to 0-based
 	    opt.barcodeStart = cmd.get<int>("barcode_start") - 1;
 	    opt.barcodeLength = cmd.get<int>("barcode_length");
 	}
+    string matchMode = cmd.get<string>("match_mode");
+    if(matchMode == "table")
+        opt.matchMode = MATCH_MODE_TABLE;
+    else if(matchMode == "hamming")
+        opt.matchMode = MATCH_MODE_HAMMING;
+    else if(matchMode == "quality")
+        opt.matchMode = MATCH_MODE_QUALITY;
+    else if(matchMode == "whitelist")
+        opt.matchMode = MATCH_MODE_WHITELIST;
+    else if(matchMode == "edit")
+        opt.matchMode = MATCH_MODE_EDIT;
+    else
+        error_exit("Please specify match mode correctly by --match_mode, it should be table, hamming, quality, whitelist or edit");
+    opt.maxShift = cmd.get<int>("max_shift");
+    opt.prebuiltIndexFile = cmd.get<string>("prebuilt_index");
+    opt.umi = cmd.get<string>("umi");
+    opt.hoppingReport = cmd.get<string>("hopping_report");
+    opt.minPosterior = cmd.get<double>("min_posterior");
+
     opt.indexReverseComplement = cmd.exist("reverse_complement");
+    opt.byLane = cmd.exist("by_lane");
+    opt.detectIndexOrientation = !cmd.exist("keep_orientation");
     opt.debug = cmd.exist("debug");
 
     opt.validate();
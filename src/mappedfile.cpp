@@ -0,0 +1,78 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "mappedfile.h"
+#include "util.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(){
+    mData = NULL;
+    mSize = 0;
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const string& filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat status;
+    if(fstat(fd, &status) != 0 || status.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* addr = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED)
+        return false;
+    mData = (char*)addr;
+    mSize = status.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if(mData) {
+        munmap(mData, mSize);
+        mData = NULL;
+        mSize = 0;
+    }
+}
+
+void MappedFile::writeAtomically(const string& filename, const char* data, size_t len) {
+    string tmp = filename + ".tmp" + to_string(getpid());
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if(fp == NULL)
+        error_exit("Failed to write " + tmp);
+    if(fwrite(data, 1, len, fp) != len)
+        error_exit("Failed to write " + tmp);
+    fclose(fp);
+    if(rename(tmp.c_str(), filename.c_str()) != 0)
+        error_exit("Failed to rename " + tmp + " to " + filename);
+}
@@ -22,50 +22,33 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#ifndef THREAD_CONFIG_H
-#define THREAD_CONFIG_H
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
-#include <vector>
-#include "writer.h"
-#include "options.h"
-#include "simpleread.h"
-#include <atomic>
-#include "singleproducersingleconsumerlist.h"
 
 using namespace std;
 
-class ThreadConfig{
+// A read-only memory mapped file, its pages are shared by all the processes mapping it.
+// It is used to load the prebuilt barcode indexes.
+class MappedFile{
 public:
-    ThreadConfig(Options* opt,  int threadId);
-    ~ThreadConfig();
+    MappedFile();
+    ~MappedFile();
+    // return false if the file cannot be mapped
+    bool open(const string& filename);
+    void close();
+    const char* data() {return mData;}
+    size_t size() {return mSize;}
 
-    void addTask(string filename, SingleProducerSingleConsumerList<SimpleRead*>* list, bool isRead2, bool isUndetermined);
-
-    int getThreadId() {return mThreadId;}
-    void cleanup();
-
-    bool isInputCompleted();
-    void output();
-    void setOutputCompleted();
-
-private:
-    void deleteWriter();
+    // write to a temporary file and rename it, so that other processes never see a partial file
+    static void writeAtomically(const string& filename, const char* data, size_t len);
 
 private:
-    Writer* mWriter1;
-    Options* mOptions;
-
-    // for spliting output
-    int mThreadId;
-    bool mInputCompleted;
-    vector<SingleProducerSingleConsumerList<SimpleRead*>*> mDataLists;
-    vector<Writer*> mWriters;
-    vector<string> mFilenames;
-    long mSleepTime;
-
+    char* mData;
+    size_t mSize;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,135 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// A lock-free linked list for multi-producer, single-consumer threading
+// producers only swap the tail pointer, so they never block each other
+// the list always keeps a dummy head item, the consumed value lives in the next one
+// with a byte limit, the producers wait while the queued values are larger than it, until half of it is consumed
+
+#ifndef MULTIPRODUCERSINGLECONSUMERLIST_H
+#define MULTIPRODUCERSINGLECONSUMERLIST_H
+
+#include <atomic>
+#include <stdio.h>
+#include <memory.h>
+#include <cassert>
+#include "waitsignal.h"
+
+template<typename T>
+struct MpscListItem {
+public:
+    inline MpscListItem(T val, long size) {
+        value = val;
+        bytes = size;
+        nextItem = NULL;
+    }
+    inline MpscListItem() {
+        bytes = 0;
+        nextItem = NULL;
+    }
+    T value;
+    long bytes;
+    std::atomic<MpscListItem<T>*> nextItem;
+};
+
+template<typename T>
+class MultiProducerSingleConsumerList {
+public:
+    inline MultiProducerSingleConsumerList() {
+        head = new MpscListItem<T>();
+        tail = head;
+        producerFinished = false;
+        consumerFinished = false;
+        queuedBytes = 0;
+        byteLimit = 0;
+    }
+    inline ~MultiProducerSingleConsumerList() {
+        while(head != NULL) {
+            MpscListItem<T>* tmp = head;
+            head = head->nextItem.load(std::memory_order_relaxed);
+            delete tmp;
+        }
+    }
+    inline bool canBeConsumed() {
+        return head->nextItem.load(std::memory_order_acquire) != NULL;
+    }
+    // can be called from different threads concurrently, bytes is the memory held by val
+    inline void produce(T val, long bytes = 0) {
+        if(byteLimit > 0 && queuedBytes.load(std::memory_order_relaxed) > byteLimit) {
+            spaceSignal.waitUntil([this](){
+                return queuedBytes.load(std::memory_order_relaxed) <= byteLimit / 2 || consumerFinished;
+            });
+        }
+        queuedBytes += bytes;
+        MpscListItem<T>* item = new MpscListItem<T>(val, bytes);
+        MpscListItem<T>* prev = tail.exchange(item, std::memory_order_acq_rel);
+        prev->nextItem.store(item, std::memory_order_release);
+    }
+    inline T consume() {
+        MpscListItem<T>* next = head->nextItem.load(std::memory_order_acquire);
+        assert(next != NULL);
+        T val = next->value;
+        if(next->bytes > 0) {
+            long bytes = queuedBytes -= next->bytes;
+            if(byteLimit > 0 && bytes <= byteLimit / 2)
+                spaceSignal.notify();
+        }
+        MpscListItem<T>* tmp = head;
+        head = next;
+        delete tmp;
+        return val;
+    }
+    inline bool isProducerFinished() {
+        return producerFinished;
+    }
+    inline bool isConsumerFinished() {
+        return consumerFinished;
+    }
+    // should only be called after all the producers have returned from produce()
+    inline void setProducerFinished() {
+        producerFinished = true;
+    }
+    inline void setConsumerFinished() {
+        consumerFinished = true;
+        spaceSignal.notify();
+    }
+    // 0 means unlimited
+    inline void setByteLimit(long limit) {
+        byteLimit = limit;
+    }
+    inline long getQueuedBytes() {
+        return queuedBytes;
+    }
+private:
+    MpscListItem<T>* head;
+    std::atomic<MpscListItem<T>*> tail;
+    std::atomic_bool producerFinished;
+    std::atomic_bool consumerFinished;
+    std::atomic_long queuedBytes;
+    long byteLimit;
+    // the producers wait for the consumer
+    WaitSignal spaceSignal;
+};
+
+#endif
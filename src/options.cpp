@@ -31,29 +31,44 @@ SOFTWARE.
 #include <thread>
 #include "sequence.h"
 #include "fastareader.h"
+#include "whitelistindex.h"
+#include "hammingmatcher.h"
+#include "evaluator.h"
 
 Options::Options(){
     in1 = "";
     compression = 6;
     undecodedFileName = "undecoded";
     threadNum = 0;
+    demuxerThreadNum = 0;
     pairedEnd = false;
     mgiMode = false;
     mismatch = 0;
+    mismatch2 = -1;
+    autoMismatch = false;
+    byLane = false;
+    matchMode = MATCH_MODE_TABLE;
+    minPosterior = 0.99;
     barcodePlace = BARCODE_PLACE_UNKNOWN;
     barcodeStart = -1;
     barcodeLength = 0;
+    maxShift = -1;
+    inlinePlace = BARCODE_PLACE_UNKNOWN;
+    inlineMismatch = -1;
     writerBufferSize = 0x01L<<20; // 1M writer buffer for per output by default
     memoryLimitBytes = 0;
     readBufferLimitBytes = 0x01L<<33; // 8G read buffer limit by default
+    sampleBufferLimitBytes = 0;
     peReadNumGapLimit = 0x01L<<23; // 8M reads for default read1/read2 gap limit
     seqLen1 = 0;
     seqLen2 = 0;
     seqDataLen1 = 0;
     seqDataLen2 = 0;
     indexReverseComplement = false;
+    detectIndexOrientation = true;
     debug = false;
     discardUndecoded = false;
+    whitelistBarcodeLength = 0;
 }
 
 void Options::log(const string& msg) {
@@ -106,6 +121,17 @@ void Options::adjustWriterBufferSize() {
     log("writerBufferSize: " + to_string(writerBufferSize));
 }
 
+long Options::outputQueueLimit(int queues) {
+    queues = max(1, queues);
+    if(sampleBufferLimitBytes > 0) {
+        if(memoryLimitBytes > 0 && sampleBufferLimitBytes > memoryLimitBytes / queues)
+            cerr << "WARNING: the sample buffers of " << queues << " output files (" << sampleBufferLimitBytes * queues / (1024*1024) << "MB) exceed the memory limit" << endl;
+        return sampleBufferLimitBytes;
+    }
+    // no floor, so that the queues together never hold more than the read buffer
+    return max(1L, readBufferLimitBytes / queues);
+}
+
 void Options::parseSampleSheetFASTA() {
     log("FASTA format");
     FastaReader reader(samplesheet);
@@ -144,7 +170,20 @@ void Options::parseSampleSheet() {
 
     log("parsing index file: " + samplesheet);
 
+    if(matchMode == MATCH_MODE_WHITELIST && !prebuiltIndexFile.empty()) {
+        // the barcodes are in the prebuilt index, only the sample names and the barcode length are needed
+        if(WhitelistIndex::loadSamples(prebuiltIndexFile, WhitelistIndex::signature(this), samples, whitelistBarcodeLength)) {
+            log("using the prebuilt whitelist index: " + prebuiltIndexFile);
+            adjustWriterBufferSize();
+            return;
+        }
+    }
+
     if(ends_with(samplesheet, ".fasta") or ends_with(samplesheet, ".fa")) {
+        if(byLane)
+            error_exit("demultiplexing by lane needs a CSV/TSV sample sheet with a lane column");
+        if(matchMode == MATCH_MODE_WHITELIST)
+            error_exit("whitelist match mode needs a CSV/TSV sample sheet");
         return parseSampleSheetFASTA();
     }
 
@@ -154,6 +193,8 @@ void Options::parseSampleSheet() {
     char line[maxLine];
 
     string sep;
+    // in whitelist mode, the rows with a same file name go to a same sample
+    map<string, int> whitelistSampleIds;
 
     while(file.getline(line, maxLine)){
         // trim \n, \r or \r\n in the tail
@@ -186,24 +227,72 @@ void Options::parseSampleSheet() {
 
         vector<string> splitted;
         split(linestr, splitted, sep);
+        // the lane column, * or empty means all lanes
+        int lane = 0;
+        if(byLane && !splitted.empty()) {
+            string laneStr = trim(splitted[0]);
+            if(laneStr == "lane" || laneStr == "Lane")
+                continue;
+            if(!laneStr.empty() && laneStr != "*") {
+                if(laneStr.find_first_not_of("0123456789") != string::npos || atoi(laneStr.c_str()) < 1)
+                    error_exit("The lane should be a positive number, or * for all lanes: " + laneStr);
+                lane = atoi(laneStr.c_str());
+            }
+            splitted.erase(splitted.begin());
+        }
         // a valid line need 4 columns: name, left, center, right
         if(splitted.size()<2)
             continue;
 
         Sample s;
+        s.lane = lane;
         s.file = trim(splitted[0]);
         s.index1 = trim(splitted[1]);
         if(indexReverseComplement){
             Sequence seq(s.index1);
             s.index1 = seq.reverseComplement().mStr;
         }
-        if(splitted.size()>=3) {
+        if(inlinePlace != BARCODE_PLACE_UNKNOWN) {
+            // hierarchical sample sheet: filename, pool index, inline barcode, and an optional inline barcode starting pos
+            if(splitted.size()<3)
+                error_exit("For hierarchical demultiplexing, each record should have a pool index and an inline barcode: " + linestr);
+            s.inlineBarcode = trim(splitted[2]);
+            if(splitted.size()>=4 && !trim(splitted[3]).empty()) {
+                string start = trim(splitted[3]);
+                if(start.find_first_not_of("0123456789") != string::npos || atoi(start.c_str()) < 1)
+                    error_exit("The barcode starting position should be a positive number (1-based): " + start);
+                s.barcodeStart = atoi(start.c_str()) - 1;
+            }
+            log(s.file + ": " + s.index1 + " / " + s.inlineBarcode);
+            this->samples.push_back(s);
+            continue;
+        }
+
+        bool inlineBarcode = barcodePlace == BARCODE_AT_READ1 || barcodePlace == BARCODE_AT_READ2;
+        // a number in the third column can only be a starting pos
+        if(barcodePlace == BARCODE_AT_AUTO && splitted.size()>=3)
+            inlineBarcode = trim(splitted[2]).find_first_not_of("0123456789") == string::npos;
+        if(splitted.size()>=3 && inlineBarcode) {
+            // for inline barcodes, the third column is the 1-based starting pos of this sample
+            string start = trim(splitted[2]);
+            if(!start.empty()) {
+                if(start.find_first_not_of("0123456789") != string::npos || atoi(start.c_str()) < 1)
+                    error_exit("The barcode starting position should be a positive number (1-based): " + start);
+                s.barcodeStart = atoi(start.c_str()) - 1;
+            }
+        } else if(splitted.size()>=3) {
             s.index2 = trim(splitted[2]);
             if(indexReverseComplement){
                 Sequence seq(s.index2);
                 s.index2 = seq.reverseComplement().mStr;
             }
         }
+
+        if(matchMode == MATCH_MODE_WHITELIST) {
+            addWhitelistBarcode(s, whitelistSampleIds);
+            continue;
+        }
+
         log(s.file + ": " + s.index1);
 
         this->samples.push_back(s);
@@ -213,6 +302,66 @@ void Options::parseSampleSheet() {
 
 }
 
+void Options::parseUmiSegments() {
+    vector<string> segments;
+    split(umi, segments, ",");
+    for(int i=0; i<segments.size(); i++) {
+        string seg = trim(segments[i]);
+        if(seg.empty())
+            continue;
+        UmiSegment umiSeg;
+        int from = 0;
+        int to = 0;
+        char read[16];
+        if(sscanf(seg.c_str(), "%15[^:]:%d-%d", read, &from, &to) != 3 || from < 1 || to < from)
+            error_exit("UMI segment should be like read1:1-8 (1-based and inclusive), but got " + seg);
+        string readName(read);
+        if(readName == "read1")
+            umiSeg.read2 = false;
+        else if(readName == "read2") {
+            if(!pairedEnd)
+                error_exit("UMI segment " + seg + " is in read2, but read2 input is not specified");
+            umiSeg.read2 = true;
+        } else
+            error_exit("UMI segment should be in read1 or read2, but got " + seg);
+        umiSeg.start = from - 1;
+        umiSeg.length = to - from + 1;
+        umiSegments.push_back(umiSeg);
+    }
+    int umiLen = 0;
+    for(int i=0; i<umiSegments.size(); i++)
+        umiLen += umiSegments[i].length + 1;
+    if(umiLen > UMI_MAX_LEN + 1)
+        error_exit("UMI should be no longer than " + to_string(UMI_MAX_LEN) + "bp");
+}
+
+void Options::addWhitelistBarcode(Sample& s, map<string, int>& sampleIds) {
+    // index1 and index2 are matched as a whole
+    string barcode = s.index1 + s.index2;
+    if(whitelistBarcodeLength == 0)
+        whitelistBarcodeLength = barcode.length();
+    if(barcode.length() != whitelistBarcodeLength)
+        error_exit("All the whitelist barcodes should have a same length, but " + barcode + " is not " + to_string(whitelistBarcodeLength) + "bp");
+    uint64 key = 0;
+    if(!WhitelistIndex::encode(barcode.c_str(), barcode.length(), key))
+        error_exit("Whitelist barcode should be A/T/C/G only and no longer than 32bp: " + barcode);
+
+    map<string, int>::iterator iter = sampleIds.find(s.file);
+    int id = 0;
+    if(iter == sampleIds.end()) {
+        id = samples.size();
+        sampleIds[s.file] = id;
+        Sample sample;
+        sample.file = s.file;
+        samples.push_back(sample);
+        log(s.file);
+    } else {
+        id = iter->second;
+    }
+    whitelistKeys.push_back(key);
+    whitelistSamples.push_back(id);
+}
+
 bool Options::validate() {
     if(in1.empty()) {
         if(!in2.empty())
@@ -244,6 +393,30 @@ bool Options::validate() {
 
     if(samples.size() == 0)
         error_exit("no sample found, did you provide a valid index CSV file by -s or --index?");
+    if(byLane && matchMode == MATCH_MODE_WHITELIST)
+        error_exit("whitelist match mode doesn't support demultiplexing by lane");
+    assignOutputs();
+
+    if(barcodePlace == BARCODE_AT_AUTO) {
+        if(inlinePlace != BARCODE_PLACE_UNKNOWN)
+            error_exit("barcode_place cannot be auto for hierarchical demultiplexing");
+        if(matchMode == MATCH_MODE_WHITELIST)
+            error_exit("barcode_place cannot be auto in whitelist match mode");
+        Evaluator evaluator(this);
+        evaluator.detectBarcodePlace();
+    }
+
+    if(barcodePlace == BARCODE_AT_BOTH_INDEX && detectIndexOrientation && matchMode != MATCH_MODE_WHITELIST) {
+        bool dualIndex = true;
+        for(int i=0; i<samples.size(); i++) {
+            if(samples[i].index2.empty())
+                dualIndex = false;
+        }
+        if(dualIndex) {
+            Evaluator evaluator(this);
+            evaluator.detectIndexOrientation();
+        }
+    }
 
     if(threadNum > 0) {
         if(pairedEnd && threadNum<5)
@@ -255,19 +428,114 @@ bool Options::validate() {
         threadNum = max((unsigned int)5, std::thread::hardware_concurrency());
     }
 
-    if(mismatch<0 || mismatch>2)
-        error_exit("allowed mismatch should be 0 ~ 2");
+    if(demuxerThreadNum < 0)
+        error_exit("demuxer thread number should be >= 0");
+    if(demuxerThreadNum == 0) {
+        // one demuxer for every 16 threads, and at most 8 demuxers
+        demuxerThreadNum = min(8, max(1, threadNum/16));
+    }
+    // keep at least one thread for writing
+    if(threadNum - 2 - demuxerThreadNum < 1)
+        error_exit("too many demuxer threads (" + to_string(demuxerThreadNum) + ") for " + to_string(threadNum) + " threads");
+
+    if(autoMismatch) {
+        if(matchMode != MATCH_MODE_TABLE)
+            error_exit("auto mismatch is only for table match mode");
+        // the largest mismatch of table mode if it is not limited
+        if(mismatch == 0)
+            mismatch = 2;
+    }
+    if(mismatch2 < 0)
+        mismatch2 = mismatch;
+    if(inlineMismatch < 0)
+        inlineMismatch = mismatch;
+    // in quality match mode, the posterior decides if a read is assigned, the mismatch of the quality-matched barcodes
+    // is only an optional cap, and 0 means no cap. The pool index of hierarchical demultiplexing is still matched by mismatch
+    if(matchMode == MATCH_MODE_QUALITY) {
+        if(inlinePlace == BARCODE_PLACE_UNKNOWN && mismatch == 0)
+            mismatch = HAMMING_MAX_LEN;
+        if(inlineMismatch == 0)
+            inlineMismatch = HAMMING_MAX_LEN;
+    }
+
+    if(matchMode == MATCH_MODE_TABLE) {
+        if(mismatch<0 || mismatch>2 || mismatch2>2 || inlineMismatch>2)
+            error_exit("allowed mismatch should be 0 ~ 2, use --match_mode=hamming for more mismatches");
+    } else if(matchMode == MATCH_MODE_WHITELIST) {
+        if(mismatch<0 || mismatch>1)
+            error_exit("allowed mismatch should be 0 or 1 in whitelist match mode");
+    } else if(mismatch<0) {
+        error_exit("allowed mismatch should be >= 0");
+    }
 
     if(compression<0 || compression>12)
         error_exit("compression setting should be 0 ~ 12");
 
     if(barcodePlace == BARCODE_AT_READ1 || barcodePlace == BARCODE_AT_READ2) {
-        if(barcodeStart < 0)
-            error_exit("If barcode_place is read1 or read2, the barcode starting position should be specified by -s or --barcode_start");
-        if(barcodeLength == 0)
-            error_exit("If barcode_place is read1 or read2, the barcode length should be specified by -l or --barcode_length");
+        if(matchMode == MATCH_MODE_WHITELIST) {
+            if(barcodeStart < 0)
+                error_exit("If barcode_place is read1 or read2, the barcode starting position should be specified by -s or --barcode_start");
+            if(barcodeLength == 0)
+                barcodeLength = whitelistBarcodeLength;
+        } else {
+            // each sample has its own barcode start and length, so that the barcodes at different places can be demultiplexed in one pass
+            for(int i=0; i<samples.size(); i++) {
+                Sample& s = samples[i];
+                if(s.barcodeStart < 0)
+                    s.barcodeStart = barcodeStart;
+                if(s.barcodeStart < 0)
+                    error_exit("If barcode_place is read1 or read2, the barcode starting position should be specified by -s or --barcode_start, or by the third column of the sample sheet");
+                if(barcodeLength > 0 && s.index1.length() != barcodeLength)
+                    error_exit("The barcode of " + s.file + " is " + to_string(s.index1.length()) + "bp, but barcode_length is " + to_string(barcodeLength));
+            }
+        }
     }
 
+    if(inlinePlace != BARCODE_PLACE_UNKNOWN) {
+        if(barcodePlace != BARCODE_AT_INDEX1 && barcodePlace != BARCODE_AT_INDEX2 && barcodePlace != BARCODE_AT_BOTH_INDEX)
+            error_exit("For hierarchical demultiplexing, the pool index should be at index1, index2 or both_index");
+        if(matchMode == MATCH_MODE_WHITELIST)
+            error_exit("whitelist match mode doesn't support hierarchical demultiplexing");
+        if(inlinePlace == BARCODE_AT_READ2 && in2.empty())
+            error_exit("If inline_place is read2, the read2 input file should be specified by -2 or --in2");
+        for(int i=0; i<samples.size(); i++) {
+            Sample& s = samples[i];
+            if(s.barcodeStart < 0)
+                s.barcodeStart = barcodeStart;
+            if(s.barcodeStart < 0)
+                error_exit("For hierarchical demultiplexing, the inline barcode starting position should be specified by -s or --barcode_start, or by the fourth column of the sample sheet");
+            if(barcodeLength > 0 && s.inlineBarcode.length() != barcodeLength)
+                error_exit("The inline barcode of " + s.file + " is " + to_string(s.inlineBarcode.length()) + "bp, but barcode_length is " + to_string(barcodeLength));
+        }
+    }
+
+    if(!hoppingReport.empty()) {
+        if(barcodePlace != BARCODE_AT_BOTH_INDEX || inlinePlace != BARCODE_PLACE_UNKNOWN || matchMode == MATCH_MODE_WHITELIST)
+            error_exit("hopping_report is for dual index demultiplexing, barcode_place should be both_index, without inline_place or whitelist match mode");
+        for(int i=0; i<samples.size(); i++) {
+            if(samples[i].index2.empty())
+                error_exit("hopping_report needs both index1 and index2 in every record of the index file");
+        }
+    }
+
+    bool inlineBarcodes = inlineBarcodePlace() != BARCODE_PLACE_UNKNOWN;
+    if(matchMode == MATCH_MODE_EDIT) {
+        if(!inlineBarcodes)
+            error_exit("edit match mode is for the inline barcodes, barcode_place or inline_place should be read1 or read2");
+        if(maxShift < 0)
+            maxShift = mismatch;
+    }
+
+    if(matchMode == MATCH_MODE_QUALITY) {
+        if(!inlineBarcodes)
+            error_exit("quality match mode needs the base qualities, barcode_place or inline_place should be read1 or read2");
+        if(minPosterior <= 0.5 || minPosterior > 1.0)
+            error_exit("min posterior should be > 0.5 and <= 1.0");
+    }
+
+    if(!umi.empty())
+        parseUmiSegments();
+
     if(barcodePlace == BARCODE_AT_READ2) {
         if(in2.empty())
             error_exit("If barcode_place is read2, the read2 input file should be specified by -2 or --in2");
@@ -275,3 +543,23 @@ bool Options::validate() {
 
     return true;
 }
+
+void Options::assignOutputs() {
+    map<string, int> outputIds;
+    for(int i=0; i<samples.size(); i++) {
+        map<string, int>::iterator iter = outputIds.find(samples[i].file);
+        if(iter == outputIds.end()) {
+            samples[i].output = outputFiles.size();
+            outputIds[samples[i].file] = samples[i].output;
+            outputFiles.push_back(samples[i].file);
+        } else {
+            samples[i].output = iter->second;
+        }
+    }
+}
+
+int Options::inlineBarcodePlace() {
+    if(barcodePlace == BARCODE_AT_READ1 || barcodePlace == BARCODE_AT_READ2)
+        return barcodePlace;
+    return inlinePlace;
+}
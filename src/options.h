@@ -30,22 +30,45 @@ SOFTWARE.
 #include <string>
 #include <vector>
 #include <mutex>
+#include <map>
 #include "common.h"
 
 using namespace std;
 
 class Sample{
 public:
+    Sample() {barcodeStart = -1; lane = 0; output = 0;}
     string index1;
     string index2;
     string file;
+    // the inline barcode within the pool of index1, only for hierarchical demultiplexing
+    string inlineBarcode;
+    // the 0-based starting pos of the inline barcode if barcode place is read1/read2, -1 means --barcode_start
+    int barcodeStart;
+    // the lane of this record if the sample sheet has a lane column, 0 means all lanes
+    int lane;
+    // the index of the output file in Options::outputFiles, the records with a same file name share an output
+    int output;
+};
+
+// a UMI segment in read1/read2
+class UmiSegment{
+public:
+    bool read2;
+    // 0-based
+    int start;
+    int length;
 };
 
 class Options{
 public:
     Options();
     bool validate();
+    // the read having the inline barcodes: barcodePlace if it is read1/read2, or inlinePlace for hierarchical demultiplexing
+    int inlineBarcodePlace();
     void adjustWriterBufferSize();
+    // the byte limit of each of the output queues, together they are within the read buffer unless sample_buffer is set
+    long outputQueueLimit(int queues);
     void log(const string& msg);
 
 public:
@@ -65,26 +88,52 @@ public:
     string suffix1;
     // sample sheet
     vector<Sample> samples;
+    // the output files of the samples, without duplicates
+    vector<string> outputFiles;
+    // the first column of the sample sheet is the lane, so that each lane has its own samples
+    bool byLane;
     // the number of threads, 0 means auto: min(output_file_num, 128)
     int threadNum;
+    // the number of demuxer threads, 0 means auto
+    int demuxerThreadNum;
     // is paired-end mode?
     bool pairedEnd;
     // is MGI mode?
     bool mgiMode;
     // allowed mismatch
     int mismatch;
+    // allowed mismatch of index2 for independent dual index matching, -1 means same as mismatch
+    int mismatch2;
+    // pick the mismatch of each barcode from its distance to the other barcodes, the mismatch settings are the upper limits
+    bool autoMismatch;
+    // how to match the barcodes, MATCH_MODE_TABLE by default
+    int matchMode;
+    // the min posterior probability to assign a read in quality match mode
+    double minPosterior;
     // the place of barcode
     int barcodePlace;
     // the starting pos of barcode if barcode place is read1/read2
     int barcodeStart;
     // the barcode length of barcode if barcode place is read1/read2
     int barcodeLength;
+    // the UMI segments like read1:1-8,read2:1-6, 1-based and inclusive
+    string umi;
+    // the UMI segments to move from the reads to the read names
+    vector<UmiSegment> umiSegments;
+    // read1/read2 for hierarchical demultiplexing: the reads are split by the pool index at barcodePlace, then by the inline barcode in this read
+    int inlinePlace;
+    // allowed mismatch of the inline barcodes for hierarchical demultiplexing, -1 means same as mismatch
+    int inlineMismatch;
+    // in edit match mode, how many bases an inline barcode can slide from its starting pos, -1 means same as mismatch
+    int maxShift;
     // the buffer size for writer
     size_t writerBufferSize;
     // limit of memory
     long memoryLimitBytes;
-    // read buffer limit in bytes
+    // read buffer limit in bytes, shared by the output queues
     long readBufferLimitBytes;
+    // the limit of the reads queued for each output file in bytes, 0 means auto
+    long sampleBufferLimitBytes;
     // unbalanced read1/read2 number gap limit for paired-end reading
     long peReadNumGapLimit;
     // evalauted read length of read1
@@ -97,16 +146,30 @@ public:
     int seqDataLen2;
     // index reverse complement?
     bool indexReverseComplement;
+    // detect the orientations of i7 and i5 for a dual index sample sheet?
+    bool detectIndexOrientation;
     // output debug info
     bool debug;
     // mutex for logging
     mutex logmtx;
+    // the TSV file of the reads of each hopped (index1, index2) pair for dual index demultiplexing
+    string hoppingReport;
     // discard the undecoded reads?
     bool discardUndecoded;
+    // the prebuilt barcode index file of table or whitelist match mode, built if it is missing or out of date
+    string prebuiltIndexFile;
+    // the parsed whitelist barcodes (2-bit encoded) and their samples, released after the index is built
+    vector<uint64> whitelistKeys;
+    vector<uint32> whitelistSamples;
+    // the barcode length of whitelist
+    int whitelistBarcodeLength;
 
 private:
     void parseSampleSheet();
     void parseSampleSheetFASTA();
+    void parseUmiSegments();
+    void assignOutputs();
+    void addWhitelistBarcode(Sample& s, map<string, int>& sampleIds);
 
 };
 
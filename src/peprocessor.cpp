@@ -38,9 +38,15 @@ PairedEndProcessor::PairedEndProcessor(Options* opt){
     mOptions = opt;
     mProduceFinished = false;
     mDemuxer = new Demuxer(opt);
-    mSampleSize = mOptions->samples.size();
+    mSampleSize = mOptions->outputFiles.size();
     mRead1Loaded = 0;
     mRead2Loaded = 0;
+    mDemuxerThreadNum = mOptions->demuxerThreadNum;
+    mFinishedDemuxers = 0;
+    mCacheHits = 0;
+    mCacheMisses = 0;
+    mOutputLocks = NULL;
+    mWriterPool = NULL;
 }
 
 PairedEndProcessor::~PairedEndProcessor() {
@@ -49,32 +55,39 @@ PairedEndProcessor::~PairedEndProcessor() {
 
 bool PairedEndProcessor::process(){
 
-    mRead1InputList = new SingleProducerSingleConsumerList<SimpleRead*>();
-    mRead2InputList = new SingleProducerSingleConsumerList<SimpleRead*>();
+    // one pair of input lists for each demuxer thread
+    mRead1InputLists = new SingleProducerSingleConsumerRing<SimpleRead*>*[mDemuxerThreadNum];
+    mRead2InputLists = new SingleProducerSingleConsumerRing<SimpleRead*>*[mDemuxerThreadNum];
+    for(int w=0; w<mDemuxerThreadNum; w++) {
+        mRead1InputLists[w] = new SingleProducerSingleConsumerRing<SimpleRead*>();
+        mRead2InputLists[w] = new SingleProducerSingleConsumerRing<SimpleRead*>();
+    }
 
     // plus two undetermined (R1 and R2)
     mOutputNum = mSampleSize*2;
     if(!mOptions->discardUndecoded)
         mOutputNum += 2;
-    mWriterThreadNum = mOptions->threadNum - 3;
+    mWriterThreadNum = mOptions->threadNum - 2 - mDemuxerThreadNum;
     if(mWriterThreadNum <= 0)
         mWriterThreadNum = min(128, mOutputNum);
 
     if(mWriterThreadNum > mOutputNum)
         mWriterThreadNum = mOutputNum;
 
-    mOptions->log("raise " + to_string(mWriterThreadNum) + " writer threads");
+    mOptions->log("raise " + to_string(mDemuxerThreadNum) + " demuxer threads and " + to_string(mWriterThreadNum) + " writer threads");
 
-    mConfigs = new ThreadConfig*[mWriterThreadNum];
-    for(int t=0; t<mWriterThreadNum; t++){
-        mConfigs[t] = new ThreadConfig(mOptions, t);
-    }
+    mWriterPool = new WriterPool(mOptions, mWriterThreadNum);
+
+    if(mDemuxerThreadNum > 1)
+        mOutputLocks = new mutex[mOutputNum/2];
 
-    mOutputLists = new SingleProducerSingleConsumerList<SimpleRead*>*[mOutputNum];
+    long queueLimit = mOptions->outputQueueLimit(mOutputNum);
+    mOptions->log("output queue limit: " + to_string(queueLimit) + " bytes");
+    mOutputLists = new MultiProducerSingleConsumerList<SimpleRead*>*[mOutputNum];
     for(int i=0; i<mOutputNum; i++){
-        mOutputLists[i] = new SingleProducerSingleConsumerList<SimpleRead*>();
-        // assign the write task to a writer thread
-        int t = i % mWriterThreadNum;
+        mOutputLists[i] = new MultiProducerSingleConsumerList<SimpleRead*>();
+        mOutputLists[i]->setByteLimit(queueLimit);
+        // the output id in the writer pool is also i
         string suffix;
         bool isRead2 = false;
         if(i%2!=0)
@@ -85,35 +98,43 @@ bool PairedEndProcessor::process(){
         else
             suffix = ".R2";
         if(i < mSampleSize*2)
-            mConfigs[t] -> addTask(mOptions->samples[i/2].file + suffix, mOutputLists[i], isRead2, false);
+            mWriterPool->addOutput(mOptions->outputFiles[i/2] + suffix, mOutputLists[i], isRead2, false);
         else
-            mConfigs[t] -> addTask(mOptions->undecodedFileName + suffix, mOutputLists[i], isRead2, true);
+            mWriterPool->addOutput(mOptions->undecodedFileName + suffix, mOutputLists[i], isRead2, true);
     }
 
 
     std::thread reader1(std::bind(&PairedEndProcessor::reader1Task, this));
     std::thread reader2(std::bind(&PairedEndProcessor::reader2Task, this));
 
-    std::thread** writerThreads = new thread*[mWriterThreadNum];
-    for(int t=0; t<mWriterThreadNum; t++){
-        writerThreads[t] = new std::thread(std::bind(&PairedEndProcessor::writerTask, this, mConfigs[t]));
-    }
+    mWriterPool->start();
 
-    std::thread demuxer(std::bind(&PairedEndProcessor::demuxerTask, this));
+    std::thread** demuxerThreads = new thread*[mDemuxerThreadNum];
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        demuxerThreads[w] = new std::thread(std::bind(&PairedEndProcessor::demuxerTask, this, w));
+    }
 
     reader1.join();
     reader2.join();
-    demuxer.join();
-    for(int t=0; t<mWriterThreadNum; t++){
-        writerThreads[t]->join();
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        demuxerThreads[w]->join();
     }
+    mWriterPool->finish();
+
+    if(mDemuxer->indexHoppedReads() > 0)
+        mOptions->log("index hopped reads: " + to_string(mDemuxer->indexHoppedReads()));
+    mDemuxer->writeHoppingReport();
+    long lookups = mCacheHits + mCacheMisses;
+    if(lookups > 0)
+        mOptions->log("barcode cache hits: " + to_string(mCacheHits) + ", misses: " + to_string(mCacheMisses) + ", hit rate: " + to_string(mCacheHits * 100 / lookups) + "%");
 
     // clean up
-    for(int t=0; t<mWriterThreadNum; t++){
-        delete writerThreads[t];
-        writerThreads[t] = NULL;
-        delete mConfigs[t];
-        mConfigs[t] = NULL;
+    delete mWriterPool;
+    mWriterPool = NULL;
+
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        delete demuxerThreads[w];
+        demuxerThreads[w] = NULL;
     }
 
     // clean up lists
@@ -121,17 +142,27 @@ bool PairedEndProcessor::process(){
         delete mOutputLists[i];
         mOutputLists[i] = NULL;
     }
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        delete mRead1InputLists[w];
+        mRead1InputLists[w] = NULL;
+        delete mRead2InputLists[w];
+        mRead2InputLists[w] = NULL;
+    }
 
-    delete[] writerThreads;
-    delete mConfigs;
-    delete mRead1InputList;
-    delete mRead2InputList;
+    delete[] demuxerThreads;
+    delete[] mOutputLists;
+    delete[] mRead1InputLists;
+    delete[] mRead2InputLists;
+    if(mOutputLocks) {
+        delete[] mOutputLocks;
+        mOutputLocks = NULL;
+    }
 
     return true;
 }
 
-bool PairedEndProcessor::processPairedEnd(SimpleRead* r1, SimpleRead* r2){
-    int sample = mDemuxer->demux(r1, r2);
+bool PairedEndProcessor::processPairedEnd(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context){
+    int sample = mDemuxer->demux(r1, r2, context);
     // Undetermined
     if(sample < 0) {
         if(!mOptions->discardUndecoded)
@@ -144,35 +175,41 @@ bool PairedEndProcessor::processPairedEnd(SimpleRead* r1, SimpleRead* r2){
             return true;
         }
     }
-    mOutputLists[(sample*2)]->produce(r1);
-    mOutputLists[(sample*2+1)]->produce(r2);
+    if(mOutputLocks) {
+        lock_guard<mutex> guard(mOutputLocks[sample]);
+        mOutputLists[(sample*2)]->produce(r1, r1->dataLen() + sizeof(SimpleRead));
+        mOutputLists[(sample*2+1)]->produce(r2, r2->dataLen() + sizeof(SimpleRead));
+    } else {
+        mOutputLists[(sample*2)]->produce(r1, r1->dataLen() + sizeof(SimpleRead));
+        mOutputLists[(sample*2+1)]->produce(r2, r2->dataLen() + sizeof(SimpleRead));
+    }
+    mWriterPool->notify(sample*2);
+    mWriterPool->notify(sample*2+1);
     return true;
 }
 
 
 void PairedEndProcessor::reader1Task()
 {
-    long readNum = 0;
     FastqReader reader(mOptions->in1);
     long count=0;
-    long sleepTimeMemExceeded = 0;
+    long dropped = 0;
     long sleepTimeUnbalanced = 0;
     while(true){
         SimpleRead* read = reader.read();
         if(!read){
             break;
         } else {
-            mRead1InputList->produce(read);
+            // every 256 continuous pairs are sent to a same demuxer
+            // the demuxer is gone if read2 has no more reads, the extra reads of read1 are dropped
+            if(!mRead1InputLists[(count >> 8) % mDemuxerThreadNum]->produce(read)) {
+                delete read;
+                dropped++;
+            }
             mRead1Loaded++;
         }
         count++;
         if((count & 0xFF) == 0xFF) {
-            //for every 128 reads, if in memory queue too large, sleep 1s
-            if(globalReadBytesInMem > mOptions->readBufferLimitBytes) {
-                sleepTimeMemExceeded++;
-                mOptions->log(to_string(sleepTimeMemExceeded) + " time reader1 sleeps due to globalReadBytesInMem: "+  to_string(globalReadBytesInMem ));
-                sleep(1);
-            }
             //unbalanced reading for PE, sleep
             if(mRead1Loaded - mRead2Loaded > mOptions->peReadNumGapLimit) {
                 sleepTimeUnbalanced++;
@@ -181,33 +218,34 @@ void PairedEndProcessor::reader1Task()
             }
         }
     }
-    mRead1InputList->setProducerFinished();
-    mOptions->log("reader1 thread exited with sleep time: " + to_string(sleepTimeMemExceeded + sleepTimeUnbalanced));
+    for(int w=0; w<mDemuxerThreadNum; w++)
+        mRead1InputLists[w]->setProducerFinished();
+    if(dropped > 0)
+        cerr << "WARNING: read1 has more reads than read2, " << dropped << " unpaired reads are dropped" << endl;
+    mOptions->log("reader1 thread exited with sleep time: " + to_string(sleepTimeUnbalanced));
 }
 
 void PairedEndProcessor::reader2Task()
 {
-    long readNum = 0;
     FastqReader reader(mOptions->in2);
     long count=0;
-    long sleepTimeMemExceeded = 0;
+    long dropped = 0;
     long sleepTimeUnbalanced = 0;
     while(true){
         SimpleRead* read = reader.read();
         if(!read){
             break;
         } else {
-            mRead2InputList->produce(read);
+            // every 256 continuous pairs are sent to a same demuxer
+            // the demuxer is gone if read1 has no more reads, the extra reads of read2 are dropped
+            if(!mRead2InputLists[(count >> 8) % mDemuxerThreadNum]->produce(read)) {
+                delete read;
+                dropped++;
+            }
             mRead2Loaded++;
         }
         count++;
         if((count & 0xFF) == 0xFF) {
-            //for every 128 reads, if memory usage exceeded, or in memory queue too large, sleep
-            if(globalReadBytesInMem > mOptions->readBufferLimitBytes) {
-                sleepTimeMemExceeded++;
-                mOptions->log(to_string(sleepTimeMemExceeded) + " time reader2 sleeps due to globalReadBytesInMem: "+  to_string(globalReadBytesInMem ));
-                sleep(1);
-            }
             //unbalanced reading for PE, sleep
             if(mRead2Loaded - mRead1Loaded > mOptions->peReadNumGapLimit) {
                 sleepTimeUnbalanced++;
@@ -216,44 +254,46 @@ void PairedEndProcessor::reader2Task()
             }
         }
     }
-    mRead2InputList->setProducerFinished();
-    mOptions->log("reader2 thread exited with sleep time: " + to_string(sleepTimeMemExceeded + sleepTimeUnbalanced));
+    for(int w=0; w<mDemuxerThreadNum; w++)
+        mRead2InputLists[w]->setProducerFinished();
+    if(dropped > 0)
+        cerr << "WARNING: read2 has more reads than read1, " << dropped << " unpaired reads are dropped" << endl;
+    mOptions->log("reader2 thread exited with sleep time: " + to_string(sleepTimeUnbalanced));
 }
 
-void PairedEndProcessor::demuxerTask()
+void PairedEndProcessor::demuxerTask(int worker)
 {
     long sleepTime=0;
+    DemuxerContext context;
+    SingleProducerSingleConsumerRing<SimpleRead*>* read1InputList = mRead1InputLists[worker];
+    SingleProducerSingleConsumerRing<SimpleRead*>* read2InputList = mRead2InputLists[worker];
     while(true) {
-        while(mRead1InputList->canBeConsumed() && mRead2InputList->canBeConsumed()) {
-            SimpleRead* r1 = mRead1InputList->consume();
-            SimpleRead* r2 = mRead2InputList->consume();
-            processPairedEnd(r1, r2);
+        while(read1InputList->canBeConsumed() && read2InputList->canBeConsumed()) {
+            SimpleRead* r1 = read1InputList->consume();
+            SimpleRead* r2 = read2InputList->consume();
+            processPairedEnd(r1, r2, &context);
         }
-        if(mRead1InputList->isProducerFinished() && !mRead1InputList->canBeConsumed()) {
+        if(read1InputList->isProducerFinished() && !read1InputList->canBeConsumed()) {
             break;
-        } else if(mRead2InputList->isProducerFinished() && !mRead2InputList->canBeConsumed()) {
+        } else if(read2InputList->isProducerFinished() && !read2InputList->canBeConsumed()) {
             break;
         } else {
-            usleep(1);
-            sleepTime++;
+            // wait for the mates one by one, until both can be consumed
+            if(!read1InputList->canBeConsumed())
+                sleepTime += read1InputList->waitForData();
+            else
+                sleepTime += read2InputList->waitForData();
         }
     }
-    mRead1InputList->setConsumerFinished();
-    mRead2InputList->setConsumerFinished();
-    for(int i=0; i<mOutputNum; i++)
-        mOutputLists[i]->setProducerFinished();
-    mOptions->log("demuxer thread exited with sleep time: " + to_string(sleepTime));
-}
-
-void PairedEndProcessor::writerTask(ThreadConfig* config)
-{
-    while(true) {
-        if(config->isInputCompleted()){
-            // check one more time to prevent possible loss of data
-            config->output();
-            break;
-        }
-        config->output();
+    read1InputList->setConsumerFinished();
+    read2InputList->setConsumerFinished();
+    mCacheHits += context.cache.hits();
+    mCacheMisses += context.cache.misses();
+    mDemuxer->addHoppedPairs(context);
+    // the last exited demuxer marks the output lists finished, the writer pool is finished after the demuxers are joined
+    if(++mFinishedDemuxers == mDemuxerThreadNum) {
+        for(int i=0; i<mOutputNum; i++)
+            mOutputLists[i]->setProducerFinished();
     }
-    config->setOutputCompleted();
-}
\ No newline at end of file
+    mOptions->log("demuxer thread " + to_string(worker) + " exited with sleep time: " + to_string(sleepTime));
+}
@@ -34,9 +34,10 @@ SOFTWARE.
 #include <mutex>
 #include <thread>
 #include "options.h"
-#include "threadconfig.h"
+#include "writerpool.h"
 #include "demuxer.h"
-#include "singleproducersingleconsumerlist.h"
+#include "singleproducersingleconsumerring.h"
+#include "multiproducersingleconsumerlist.h"
 
 using namespace std;
 
@@ -48,22 +49,28 @@ public:
     bool process();
 
 private:
-    bool processPairedEnd(SimpleRead* r1, SimpleRead* r2);
+    bool processPairedEnd(SimpleRead* r1, SimpleRead* r2, DemuxerContext* context);
     void reader1Task();
     void reader2Task();
-    void demuxerTask();
-    void writerTask(ThreadConfig* config);
+    void demuxerTask(int worker);
 
 private:
     Options* mOptions;
     bool mProduceFinished;
-    ThreadConfig** mConfigs;
-    SingleProducerSingleConsumerList<SimpleRead*>* mRead1InputList;
-    SingleProducerSingleConsumerList<SimpleRead*>* mRead2InputList;
-    SingleProducerSingleConsumerList<SimpleRead*>** mOutputLists;
+    WriterPool* mWriterPool;
+    SingleProducerSingleConsumerRing<SimpleRead*>** mRead1InputLists;
+    SingleProducerSingleConsumerRing<SimpleRead*>** mRead2InputLists;
+    MultiProducerSingleConsumerList<SimpleRead*>** mOutputLists;
+    // keep R1/R2 outputs of a sample in the same order when demuxing with multiple threads
+    mutex* mOutputLocks;
     Demuxer* mDemuxer;
     int mSampleSize;
     int mWriterThreadNum;
+    int mDemuxerThreadNum;
+    atomic_int mFinishedDemuxers;
+    // the barcode cache hits and misses of all demuxer threads
+    atomic_long mCacheHits;
+    atomic_long mCacheMisses;
     atomic_long mRead1Loaded;
     atomic_long mRead2Loaded;
     int mOutputNum;
@@ -38,8 +38,13 @@ SingleEndProcessor::SingleEndProcessor(Options* opt){
     mOptions = opt;
     mProduceFinished = false;
     mDemuxer = new Demuxer(opt);
-    mSampleSize = mOptions->samples.size();
+    mSampleSize = mOptions->outputFiles.size();
     mWriterThreadNum = 0;
+    mWriterPool = NULL;
+    mDemuxerThreadNum = mOptions->demuxerThreadNum;
+    mFinishedDemuxers = 0;
+    mCacheHits = 0;
+    mCacheMisses = 0;
 }
 
 SingleEndProcessor::~SingleEndProcessor() {
@@ -47,59 +52,68 @@ SingleEndProcessor::~SingleEndProcessor() {
 }
 
 bool SingleEndProcessor::process(){
-    mInputList = new SingleProducerSingleConsumerList<SimpleRead*>();
-
+    // one input list for each demuxer thread
+    mInputLists = new SingleProducerSingleConsumerRing<SimpleRead*>*[mDemuxerThreadNum];
+    for(int w=0; w<mDemuxerThreadNum; w++)
+        mInputLists[w] = new SingleProducerSingleConsumerRing<SimpleRead*>();
 
     // plus one undetermined
     mOutputNum = mSampleSize;
     if(!mOptions->discardUndecoded)
         mOutputNum += 1;
-    mWriterThreadNum = mOptions->threadNum - 3;
+    mWriterThreadNum = mOptions->threadNum - 2 - mDemuxerThreadNum;
     if(mWriterThreadNum <= 0)
         mWriterThreadNum = min(128, mOutputNum);
 
     if(mWriterThreadNum > mOutputNum)
         mWriterThreadNum = mOutputNum;
 
-    mOptions->log("raise " + to_string(mWriterThreadNum) + " writer threads");
+    mOptions->log("raise " + to_string(mDemuxerThreadNum) + " demuxer threads and " + to_string(mWriterThreadNum) + " writer threads");
 
-    mConfigs = new ThreadConfig*[mWriterThreadNum];
-    for(int t=0; t<mWriterThreadNum; t++){
-        mConfigs[t] = new ThreadConfig(mOptions, t);
-    }
+    mWriterPool = new WriterPool(mOptions, mWriterThreadNum);
 
-    mOutputLists = new SingleProducerSingleConsumerList<SimpleRead*>*[mOutputNum];
+    long queueLimit = mOptions->outputQueueLimit(mOutputNum);
+    mOptions->log("output queue limit: " + to_string(queueLimit) + " bytes");
+    mOutputLists = new MultiProducerSingleConsumerList<SimpleRead*>*[mOutputNum];
     for(int i=0; i<mOutputNum; i++){
-        mOutputLists[i] = new SingleProducerSingleConsumerList<SimpleRead*>();
-        // assign the write task to a writer thread
-        int t = i % mWriterThreadNum;
+        mOutputLists[i] = new MultiProducerSingleConsumerList<SimpleRead*>();
+        mOutputLists[i]->setByteLimit(queueLimit);
+        // the output id in the writer pool is also i
         if(i < mSampleSize)
-            mConfigs[t] -> addTask(mOptions->samples[i].file, mOutputLists[i], false, false);
+            mWriterPool->addOutput(mOptions->outputFiles[i], mOutputLists[i], false, false);
         else
-            mConfigs[t] -> addTask(mOptions->undecodedFileName, mOutputLists[i], false, true);
+            mWriterPool->addOutput(mOptions->undecodedFileName, mOutputLists[i], false, true);
     }
 
     std::thread producer(std::bind(&SingleEndProcessor::readerTask, this));
 
-    std::thread** writerThreads = new thread*[mWriterThreadNum];
-    for(int t=0; t<mWriterThreadNum; t++){
-        writerThreads[t] = new std::thread(std::bind(&SingleEndProcessor::writerTask, this, mConfigs[t]));
-    }
+    mWriterPool->start();
 
-    std::thread demuxer(std::bind(&SingleEndProcessor::demuxerTask, this));
+    std::thread** demuxerThreads = new thread*[mDemuxerThreadNum];
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        demuxerThreads[w] = new std::thread(std::bind(&SingleEndProcessor::demuxerTask, this, w));
+    }
 
     producer.join();
-    demuxer.join();
-    for(int t=0; t<mWriterThreadNum; t++){
-        writerThreads[t]->join();
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        demuxerThreads[w]->join();
     }
+    mWriterPool->finish();
+
+    if(mDemuxer->indexHoppedReads() > 0)
+        mOptions->log("index hopped reads: " + to_string(mDemuxer->indexHoppedReads()));
+    mDemuxer->writeHoppingReport();
+    long lookups = mCacheHits + mCacheMisses;
+    if(lookups > 0)
+        mOptions->log("barcode cache hits: " + to_string(mCacheHits) + ", misses: " + to_string(mCacheMisses) + ", hit rate: " + to_string(mCacheHits * 100 / lookups) + "%");
 
     // clean up
-    for(int t=0; t<mWriterThreadNum; t++){
-        delete writerThreads[t];
-        writerThreads[t] = NULL;
-        delete mConfigs[t];
-        mConfigs[t] = NULL;
+    delete mWriterPool;
+    mWriterPool = NULL;
+
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        delete demuxerThreads[w];
+        demuxerThreads[w] = NULL;
     }
 
     // clean up lists
@@ -107,16 +121,20 @@ bool SingleEndProcessor::process(){
         delete mOutputLists[i];
         mOutputLists[i] = NULL;
     }
+    for(int w=0; w<mDemuxerThreadNum; w++){
+        delete mInputLists[w];
+        mInputLists[w] = NULL;
+    }
 
-    delete[] writerThreads;
-    delete mConfigs;
-    delete mInputList;
+    delete[] demuxerThreads;
+    delete[] mOutputLists;
+    delete[] mInputLists;
 
     return true;
 }
 
-bool SingleEndProcessor::processSingleEnd(SimpleRead* r){
-    int sample = mDemuxer->demux(r);
+bool SingleEndProcessor::processSingleEnd(SimpleRead* r, DemuxerContext* context){
+    int sample = mDemuxer->demux(r, context);
     // Undetermined
     if(sample < 0) {
         if(!mOptions->discardUndecoded)
@@ -127,72 +145,57 @@ bool SingleEndProcessor::processSingleEnd(SimpleRead* r){
             return true;
         }
     }
-    mOutputLists[sample]->produce(r);
+    mOutputLists[sample]->produce(r, r->dataLen() + sizeof(SimpleRead));
+    mWriterPool->notify(sample);
     return true;
 }
 
 
 void SingleEndProcessor::readerTask()
 {
-    long sleepTime = 0;
-    int slept = 0;
-    long readNum = 0;
-    int sleepTimeMemExceeded = 0;
     FastqReader reader(mOptions->in1);
-    int count=0;
+    long count=0;
     while(true){
         SimpleRead* read = reader.read();
         if(!read){
             break;
         } else {
-            mInputList->produce(read);
+            // every 256 continuous reads are sent to a same demuxer
+            // the reader waits if the ring is full, and a demuxer waits if an output list is over its byte limit
+            mInputLists[(count >> 8) % mDemuxerThreadNum]->produce(read);
         }
         count++;
-        if((count & 0xFF) == 0xFF) {
-            //for every 128 reads, if memory usage exceeded, or in memory queue too large, sleep
-            if(globalReadBytesInMem > mOptions->readBufferLimitBytes) {
-                sleepTimeMemExceeded++;
-                mOptions->log(to_string(sleepTimeMemExceeded) + " time reader sleeps due to globalReadBytesInMem: "+  to_string(globalReadBytesInMem ));
-                sleep(1);
-                sleepTime++;
-            }
-        }
     }
-    mInputList->setProducerFinished();
-    mOptions->log("reader thread exited with sleep time: " + to_string(sleepTime));
+    for(int w=0; w<mDemuxerThreadNum; w++)
+        mInputLists[w]->setProducerFinished();
+    mOptions->log("reader thread exited with " + to_string(count) + " reads");
 }
 
-void SingleEndProcessor::demuxerTask()
+void SingleEndProcessor::demuxerTask(int worker)
 {
     long sleepTime = 0;
+    DemuxerContext context;
+    SingleProducerSingleConsumerRing<SimpleRead*>* inputList = mInputLists[worker];
     while(true) {
-        while(mInputList->canBeConsumed()) {
-            SimpleRead* r = mInputList->consume();
-            processSingleEnd(r);
+        while(inputList->canBeConsumed()) {
+            SimpleRead* r = inputList->consume();
+            processSingleEnd(r, &context);
         }
-        if(mInputList->isProducerFinished()) {
-            if(!mInputList->canBeConsumed())
+        if(inputList->isProducerFinished()) {
+            if(!inputList->canBeConsumed())
                 break;
         } else {
-            usleep(1);
-            sleepTime++;
+            sleepTime += inputList->waitForData();
         }
     }
-    mInputList->setConsumerFinished();
-    for(int i=0; i<mOutputNum; i++)
-        mOutputLists[i]->setProducerFinished();
-    mOptions->log("demuxer thread exited with sleep time: " + to_string(sleepTime));
-}
-
-void SingleEndProcessor::writerTask(ThreadConfig* config)
-{
-    while(true) {
-        if(config->isInputCompleted()){
-            // check one more time to prevent possible loss of data
-            config->output();
-            break;
-        }
-        config->output();
+    inputList->setConsumerFinished();
+    mCacheHits += context.cache.hits();
+    mCacheMisses += context.cache.misses();
+    mDemuxer->addHoppedPairs(context);
+    // the last exited demuxer marks the output lists finished, the writer pool is finished after the demuxers are joined
+    if(++mFinishedDemuxers == mDemuxerThreadNum) {
+        for(int i=0; i<mOutputNum; i++)
+            mOutputLists[i]->setProducerFinished();
     }
-    config->setOutputCompleted();
-}
\ No newline at end of file
+    mOptions->log("demuxer thread " + to_string(worker) + " exited with sleep time: " + to_string(sleepTime));
+}
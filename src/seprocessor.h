@@ -34,9 +34,10 @@ SOFTWARE.
 #include <mutex>
 #include <thread>
 #include "options.h"
-#include "threadconfig.h"
+#include "writerpool.h"
 #include "demuxer.h"
-#include "singleproducersingleconsumerlist.h"
+#include "singleproducersingleconsumerring.h"
+#include "multiproducersingleconsumerlist.h"
 
 using namespace std;
 
@@ -48,20 +49,24 @@ public:
     bool process();
 
 private:
-    bool processSingleEnd(SimpleRead* r);
+    bool processSingleEnd(SimpleRead* r, DemuxerContext* context);
     void readerTask();
-    void demuxerTask();
-    void writerTask(ThreadConfig* config);
+    void demuxerTask(int worker);
 
 private:
     Options* mOptions;
     bool mProduceFinished;
-    ThreadConfig** mConfigs;
-    SingleProducerSingleConsumerList<SimpleRead*>* mInputList;
-    SingleProducerSingleConsumerList<SimpleRead*>** mOutputLists;
+    WriterPool* mWriterPool;
+    SingleProducerSingleConsumerRing<SimpleRead*>** mInputLists;
+    MultiProducerSingleConsumerList<SimpleRead*>** mOutputLists;
     Demuxer* mDemuxer;
     int mSampleSize;
     int mWriterThreadNum;
+    int mDemuxerThreadNum;
+    atomic_int mFinishedDemuxers;
+    // the barcode cache hits and misses of all demuxer threads
+    atomic_long mCacheHits;
+    atomic_long mCacheMisses;
     int mOutputNum;
 };
 
@@ -39,6 +39,10 @@ SimpleRead::~SimpleRead() {
 		tfree(mData);
 		mData = NULL;
 	}
+	if(mUmi) {
+		tfree(mUmi);
+		mUmi = NULL;
+	}
 	globalReadBytesInMem -= (mDataLen + sizeof(SimpleRead));
 }
 
@@ -89,6 +93,17 @@ void SimpleRead::setData(char* d, unsigned int len) {
 		mQualLen--;
 }
 
+void SimpleRead::setUmi(const char* umi, unsigned int len) {
+	if(mUmi)
+		tfree(mUmi);
+	mUmi = NULL;
+	mUmiLen = len;
+	if(len > 0) {
+		mUmi = (char*)tmalloc(len);
+		memcpy(mUmi, umi, len);
+	}
+}
+
 unsigned int SimpleRead::dataLen() {
 	return mDataLen;
 }
@@ -134,7 +149,7 @@ bool SimpleRead::getIlluminaIndex1Place(unsigned int &start, unsigned int &len)
 	unsigned int p = end;
 	unsigned int plusPos = 0;
 	unsigned int lastBase = 0;
-	while(p>=0) {
+	while(p>0) {
 		// find the last colon
 		if(mData[p] == ':')
 			break;
@@ -166,7 +181,7 @@ bool SimpleRead::getIlluminaIndex2Place(unsigned int &start, unsigned int &len)
 	unsigned int p = end;
 	unsigned int plusPos = 0;
 	unsigned int lastBase = 0;
-	while(p>=0) {
+	while(p>0) {
 		// find the last colon
 		if(mData[p] == ':')
 			break;
@@ -197,7 +212,7 @@ bool SimpleRead::getIlluminaBothIndexPlaces(unsigned int &start1, unsigned int &
 	unsigned int p = end;
 	unsigned int plusPos = 0;
 	unsigned int lastBase = 0;
-	while(p>=0) {
+	while(p>0) {
 		// find the last colon
 		if(mData[p] == ':')
 			break;
@@ -233,6 +248,29 @@ void SimpleRead::print() {
 	cout<<qual<<endl;
 }
 
+int SimpleRead::getIlluminaLane() {
+	// skip @instrument:run:flowcell:
+	unsigned int p = 1;
+	int colons = 0;
+	while(p < mSeqStart && colons < 3) {
+		if(mData[p] == ' ' || mData[p] == '\t' || mData[p] == '\n')
+			return -1;
+		if(mData[p] == ':')
+			colons++;
+		p++;
+	}
+	int lane = 0;
+	int digits = 0;
+	while(p < mSeqStart && mData[p] >= '0' && mData[p] <= '9' && digits < 4) {
+		lane = lane * 10 + (mData[p] - '0');
+		digits++;
+		p++;
+	}
+	if(colons < 3 || digits == 0 || p >= mSeqStart || mData[p] != ':')
+		return -1;
+	return lane;
+}
+
 bool SimpleRead::test() {
 	string s("@NB551106:9:H5Y5GBGX2:1:11207:3263:19029 1:N:0:GATCAG+AATACG\rGGCTCACTGCAACCTCTGCCGCCTGGATTCAAGT\r+\rAAAAAEAEEE/A/AAEEE/E/A<EA<EEEAEEEE\r");
 	char* mData = new char[s.length()];
@@ -251,8 +289,9 @@ bool SimpleRead::test() {
 	if(hasTwoIndexes) {
 		cerr << "both index: " << string(read->mData + s1, l1) + string(read->mData + s2, l2) << endl;
 	}
+	int lane = read->getIlluminaLane();
 	delete read;
-	return true;
+	return lane == 1;
 }
 
 void SimpleRead::initCounter() {
@@ -49,9 +49,19 @@ public:
     void setNameLen(unsigned int len);
     void setSeq(unsigned int start, unsigned int len);
     void setQual(unsigned int start, unsigned int len);
+    // the matched inline barcode, its start is relative to the sequence, the length is 0 if there is none
+    void setBarcodeSpan(unsigned int start, unsigned int len) {mBarcodeStart = start; mBarcodeLen = len;}
+    unsigned int barcodeStart() {return mBarcodeStart;}
+    unsigned int barcodeLen() {return mBarcodeLen;}
+    // the UMI to be added to the read name, the bases are copied
+    void setUmi(const char* umi, unsigned int len);
+    const char* umi() {return mUmi;}
+    unsigned int umiLen() {return mUmiLen;}
     bool getIlluminaIndex1Place(unsigned int &start, unsigned int &len);
     bool getIlluminaIndex2Place(unsigned int &start, unsigned int &len);
     bool getIlluminaBothIndexPlaces(unsigned int &start1, unsigned int &len1, unsigned int &start2, unsigned int &len2);
+    // the lane in the read name (@instrument:run:flowcell:lane:tile:x:y), or -1
+    int getIlluminaLane();
 
 public:
     static bool test();
@@ -69,6 +79,10 @@ private:
     unsigned int mSeqStart;
     unsigned int mQualLen;
     unsigned int mQualStart;
+    unsigned int mBarcodeStart;
+    unsigned int mBarcodeLen;
+    char* mUmi;
+    unsigned int mUmiLen;
 };
 
 #endif
\ No newline at end of file
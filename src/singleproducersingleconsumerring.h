@@ -0,0 +1,251 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// A bounded lock-free ring for single-producer, single-consumer threading.
+// The items are handed over in batches written in place in the ring, so nothing is allocated per item,
+// and the producer and the consumer only touch the shared indexes once per batch.
+
+#ifndef SINGLEPRODUCERSINGLECONSUMERRING_H
+#define SINGLEPRODUCERSINGLECONSUMERRING_H
+
+#include <atomic>
+#include <stdio.h>
+#include <cassert>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include "singleproducersingleconsumerlist.h"
+#include "waitsignal.h"
+
+// the items in a batch, the readers send 256 continuous reads to a same demuxer, so a batch is full when they switch
+const int SPSC_RING_BATCH = 256;
+// the batches of a ring by default, so a ring holds at most 16K items
+const int SPSC_RING_CAPACITY = 64;
+const int SPSC_CACHE_LINE = 64;
+
+template<typename T>
+struct RingBatch {
+    T items[SPSC_RING_BATCH];
+    int size;
+    // the next batch starts on another cache line
+    char padding[SPSC_CACHE_LINE - sizeof(int)];
+};
+
+template<typename T>
+class SingleProducerSingleConsumerRing {
+public:
+    // capacity is rounded up to a power of 2
+    inline SingleProducerSingleConsumerRing(int capacity = SPSC_RING_CAPACITY) {
+        mCapacity = 1;
+        while(mCapacity < capacity)
+            mCapacity <<= 1;
+        mMask = mCapacity - 1;
+        mBatches = new RingBatch<T>[mCapacity];
+        mTail = 0;
+        mCachedHead = 0;
+        mProducing = NULL;
+        mHead = 0;
+        mCachedTail = 0;
+        mConsuming = NULL;
+        mConsumePos = 0;
+        producerFinished = false;
+        consumerFinished = false;
+    }
+    inline ~SingleProducerSingleConsumerRing() {
+        delete[] mBatches;
+    }
+
+    // the producer side, produce() waits if the ring is full
+    // returns false if the consumer is finished, then val is not taken and the caller still owns it
+    inline bool produce(T val) {
+        if(mProducing == NULL) {
+            mProducing = acquireBatch();
+            if(mProducing == NULL)
+                return false;
+        }
+        mProducing->items[mProducing->size++] = val;
+        if(mProducing->size == SPSC_RING_BATCH)
+            flush();
+        return true;
+    }
+    // hand over the batch being filled
+    inline void flush() {
+        if(mProducing == NULL)
+            return;
+        mProducing = NULL;
+        mTail.store(mTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        mDataSignal.notify();
+    }
+    inline void setProducerFinished() {
+        flush();
+        producerFinished = true;
+        mDataSignal.notify();
+    }
+
+    // the consumer side, consume() can only be called if canBeConsumed() is true
+    inline bool canBeConsumed() {
+        if(mConsuming)
+            return true;
+        unsigned long head = mHead.load(std::memory_order_relaxed);
+        if(head == mCachedTail) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if(head == mCachedTail)
+                return false;
+        }
+        mConsuming = mBatches + (head & mMask);
+        mConsumePos = 0;
+        return true;
+    }
+    inline T consume() {
+        assert(mConsuming != NULL);
+        T val = mConsuming->items[mConsumePos++];
+        if(mConsumePos == mConsuming->size) {
+            // give the batch back to the producer
+            mConsuming = NULL;
+            unsigned long head = mHead.load(std::memory_order_relaxed) + 1;
+            mHead.store(head, std::memory_order_release);
+            // a waiting producer only resumes when half of the ring is free, so it is not woken for every batch
+            if(mTail.load(std::memory_order_relaxed) - head <= mCapacity / 2)
+                mSpaceSignal.notify();
+        }
+        return val;
+    }
+    // wait until an item can be consumed or the producer is finished, return the times of parking
+    inline long waitForData() {
+        return mDataSignal.waitUntil([this](){return canBeConsumed() || producerFinished;});
+    }
+    // a producer waiting for space returns, and the later produce() calls return false
+    inline void setConsumerFinished() {
+        consumerFinished = true;
+        mSpaceSignal.notify();
+    }
+
+    inline bool isProducerFinished() {
+        return producerFinished;
+    }
+    inline bool isConsumerFinished() {
+        return consumerFinished;
+    }
+
+    // check the order and completeness of the items
+    static bool test() {
+        bool passed = true;
+        // a ring of 2 batches, so that the producer waits for the consumer many times
+        SingleProducerSingleConsumerRing<long> small(2);
+        transfer(small, 1000000, passed);
+        // a batch is handed over partially filled when the producer is finished
+        SingleProducerSingleConsumerRing<long> ring;
+        transfer(ring, SPSC_RING_BATCH * 3 + 7, passed);
+        return passed;
+    }
+
+    // compare the throughput of the ring and the linked list
+    static bool benchmark() {
+        bool passed = true;
+        const long items = 100000000;
+        SingleProducerSingleConsumerRing<long> ring;
+        double ringSeconds = transfer(ring, items, passed);
+
+        // the linked list allocates an item per value, so it is tested with less items
+        const long listItems = items / 10;
+        SingleProducerSingleConsumerList<long> list;
+        double listSeconds = transfer(list, listItems, passed);
+
+        std::cerr << "SPSC ring: " << (long)(items / ringSeconds) << " items/s, linked list: " << (long)(listItems / listSeconds) << " items/s" << std::endl;
+        return passed;
+    }
+
+private:
+    // the batch to fill, or NULL if the consumer is finished
+    inline RingBatch<T>* acquireBatch() {
+        if(consumerFinished)
+            return NULL;
+        unsigned long tail = mTail.load(std::memory_order_relaxed);
+        if(tail - mCachedHead >= mCapacity) {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if(tail - mCachedHead >= mCapacity) {
+                mSpaceSignal.waitUntil([this, tail](){
+                    mCachedHead = mHead.load(std::memory_order_acquire);
+                    return tail - mCachedHead <= mCapacity / 2 || consumerFinished;
+                });
+                if(consumerFinished)
+                    return NULL;
+            }
+        }
+        RingBatch<T>* batch = mBatches + (tail & mMask);
+        batch->size = 0;
+        return batch;
+    }
+
+    // send 0 ~ items-1 through a queue, check their order, and return the seconds
+    template<typename QUEUE>
+    static double transfer(QUEUE& queue, long items, bool& passed) {
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        std::thread producer([&queue, items](){
+            for(long i=0; i<items; i++)
+                queue.produce(i);
+            queue.setProducerFinished();
+        });
+        long expected = 0;
+        while(true) {
+            while(queue.canBeConsumed()) {
+                if(queue.consume() != expected++)
+                    passed = false;
+            }
+            if(queue.isProducerFinished() && !queue.canBeConsumed())
+                break;
+            std::this_thread::yield();
+        }
+        producer.join();
+        if(expected != items)
+            passed = false;
+        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+        return std::chrono::duration<double>(t2 - t1).count();
+    }
+
+private:
+    // read-only after construction
+    RingBatch<T>* mBatches;
+    unsigned long mCapacity;
+    unsigned long mMask;
+    char mPadding0[SPSC_CACHE_LINE];
+    // written by the producer
+    std::atomic_ulong mTail;
+    unsigned long mCachedHead;
+    RingBatch<T>* mProducing;
+    char mPadding1[SPSC_CACHE_LINE];
+    // written by the consumer
+    std::atomic_ulong mHead;
+    unsigned long mCachedTail;
+    RingBatch<T>* mConsuming;
+    int mConsumePos;
+    char mPadding2[SPSC_CACHE_LINE];
+    std::atomic_bool producerFinished;
+    std::atomic_bool consumerFinished;
+    // the consumer waits for a batch, and the producer waits for a free batch
+    WaitSignal mDataSignal;
+    WaitSignal mSpaceSignal;
+};
+
+#endif
@@ -25,6 +25,14 @@ SOFTWARE.
 #include "unittest.h"
 #include "fastqreader.h"
 #include "simpleread.h"
+#include "hammingmatcher.h"
+#include "barcodeindex.h"
+#include "whitelistindex.h"
+#include "editmatcher.h"
+#include "barcodebloom.h"
+#include "demuxcache.h"
+#include "demuxer.h"
+#include "singleproducersingleconsumerring.h"
 #include <time.h>
 
 UnitTest::UnitTest(){
@@ -35,6 +43,21 @@ void UnitTest::run(){
     bool passed = true;
     passed &= report(FastqReader::test(), "FastqReader::test");
     passed &= report(SimpleRead::test(), "SimpleRead::test");
+    passed &= report(HammingMatcher::test(), "HammingMatcher::test");
+    passed &= report(BarcodeIndex::test(), "BarcodeIndex::test");
+    passed &= report(WhitelistIndex::test(), "WhitelistIndex::test");
+    passed &= report(EditMatcher::test(), "EditMatcher::test");
+    passed &= report(BarcodeBloom::test(), "BarcodeBloom::test");
+    passed &= report(DemuxCache::test(), "DemuxCache::test");
+    passed &= report(Demuxer::test(), "Demuxer::test");
+    passed &= report(SingleProducerSingleConsumerRing<long>::test(), "SingleProducerSingleConsumerRing::test");
+    printf("\n==========================\n");
+    printf("%s\n\n", passed?"ALL PASSED":"FAILED");
+}
+
+void UnitTest::benchmark(){
+    bool passed = true;
+    passed &= report(SingleProducerSingleConsumerRing<long>::benchmark(), "SingleProducerSingleConsumerRing::benchmark");
     printf("\n==========================\n");
     printf("%s\n\n", passed?"ALL PASSED":"FAILED");
 }
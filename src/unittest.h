@@ -35,6 +35,8 @@ class UnitTest{
 public:
     UnitTest();
     void run();
+    // the throughput tests, too slow for run()
+    void benchmark();
     bool report(bool result, string message);
 };
 
@@ -0,0 +1,119 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Let a consumer (or a producer of a bounded queue) wait without polling with sleeps.
+// The waiting thread spins for a while, then yields, and at last parks on a condition variable.
+// The other side calls notify() after publishing, which is only a fence and a load if nobody is parked.
+
+#ifndef WAIT_SIGNAL_H
+#define WAIT_SIGNAL_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// the rounds of checking the condition before yielding, and before parking
+const int WAIT_SPIN_ROUNDS = 256;
+const int WAIT_YIELD_ROUNDS = 16;
+
+class WaitSignal {
+public:
+    inline WaitSignal() {
+        mWaiters = 0;
+        mEpoch = 0;
+    }
+
+    // called after the data or space that a waiter may need is published
+    inline void notify() {
+        // pairs with the waiter increasing mWaiters before checking its condition
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mWaiters.load(std::memory_order_relaxed) == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            mEpoch++;
+        }
+        mCondition.notify_all();
+    }
+
+    // same as notify(), but only wakes one parked waiter, for the data that only one waiter can take
+    inline void notifyOne() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mWaiters.load(std::memory_order_relaxed) == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            mEpoch++;
+        }
+        mCondition.notify_one();
+    }
+
+    // wait until ready() is true, return the times of parking
+    template<typename CONDITION>
+    inline long waitUntil(CONDITION ready) {
+        for(int i=0; i<WAIT_SPIN_ROUNDS; i++) {
+            if(ready())
+                return 0;
+            cpuRelax();
+        }
+        for(int i=0; i<WAIT_YIELD_ROUNDS; i++) {
+            if(ready())
+                return 0;
+            std::this_thread::yield();
+        }
+        long parks = 0;
+        std::unique_lock<std::mutex> lock(mMutex);
+        while(true) {
+            mWaiters.fetch_add(1);
+            if(ready()) {
+                mWaiters.fetch_sub(1);
+                return parks;
+            }
+            // a notify() after the check above has to take the mutex, so it cannot be missed
+            long epoch = mEpoch;
+            while(mEpoch == epoch)
+                mCondition.wait(lock);
+            mWaiters.fetch_sub(1);
+            parks++;
+        }
+    }
+
+private:
+    inline static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+    }
+
+private:
+    std::atomic_int mWaiters;
+    long mEpoch;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+};
+
+#endif
@@ -0,0 +1,437 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "whitelistindex.h"
+#include "util.h"
+#include "memfunc.h"
+#include <algorithm>
+#include <sys/stat.h>
+#include <memory.h>
+#include <unistd.h>
+
+inline static uint64 alignTo8(uint64 offset) {
+    return (offset + 7) & ~((uint64)7);
+}
+
+WhitelistIndex::WhitelistIndex(Options* opt){
+    mOptions = opt;
+    mData = NULL;
+    mMapped = NULL;
+    mHeader = NULL;
+    mBuckets = NULL;
+    mKeys = NULL;
+    mSamples = NULL;
+    mBucketShift = 0;
+
+    string& filename = mOptions->prebuiltIndexFile;
+    if(!filename.empty() && load(filename)) {
+        mOptions->log("whitelist index loaded from " + filename);
+        return;
+    }
+
+    build();
+    if(!filename.empty()) {
+        MappedFile::writeAtomically(filename, mData, mHeader->fileLen);
+        mOptions->log("whitelist index saved to " + filename);
+        // use the saved file so that the memory can be shared
+        tfree(mData);
+        mData = NULL;
+        if(!load(filename))
+            error_exit("Failed to load the whitelist index just saved: " + filename);
+    }
+}
+
+WhitelistIndex::~WhitelistIndex() {
+    if(mData) {
+        tfree(mData);
+        mData = NULL;
+    }
+    if(mMapped) {
+        delete mMapped;
+        mMapped = NULL;
+    }
+}
+
+bool WhitelistIndex::encode(const char* data, size_t len, uint64& key) {
+    if(len > 32)
+        return false;
+    key = 0;
+    for(int k=0; k<len; k++) {
+        uint64 val = 0;
+        switch(data[k]){
+            case 'A': val = 0; break;
+            case 'T': val = 1; break;
+            case 'C': val = 2; break;
+            case 'G': val = 3; break;
+            default:
+                return false;
+        }
+        key = (key<<2) | val;
+    }
+    return true;
+}
+
+uint64 WhitelistIndex::signature(Options* opt) {
+    struct stat status;
+    uint64 sig = 14695981039346656037UL;
+    uint64 values[4] = {0, 0, 0, 0};
+    if(stat(opt->samplesheet.c_str(), &status) == 0) {
+        values[0] = status.st_size;
+        values[1] = status.st_mtime;
+    }
+    values[2] = opt->indexReverseComplement ? 1 : 0;
+    values[3] = WHITELIST_VERSION;
+    // FNV-1a
+    const unsigned char* p = (const unsigned char*)values;
+    for(int i=0; i<sizeof(values); i++) {
+        sig ^= p[i];
+        sig *= 1099511628211UL;
+    }
+    return sig;
+}
+
+void WhitelistIndex::build() {
+    vector<uint64>& keys = mOptions->whitelistKeys;
+    vector<uint32>& samples = mOptions->whitelistSamples;
+    uint64 count = keys.size();
+    if(count == 0)
+        error_exit("The whitelist has no barcode");
+
+    // sort the barcodes with their samples
+    vector<pair<uint64, uint32> > pairs(count);
+    for(uint64 i=0; i<count; i++)
+        pairs[i] = make_pair(keys[i], samples[i]);
+    // release the parsed whitelist
+    vector<uint64>().swap(keys);
+    vector<uint32>().swap(samples);
+    sort(pairs.begin(), pairs.end());
+
+    // remove the duplicated barcodes
+    uint64 unique = 0;
+    for(uint64 i=0; i<count; i++) {
+        if(unique > 0 && pairs[unique-1].first == pairs[i].first) {
+            if(pairs[unique-1].second != pairs[i].second)
+                error_exit("A whitelist barcode belongs to both " + mOptions->samples[pairs[i].second].file + " and " + mOptions->samples[pairs[unique-1].second].file);
+            continue;
+        }
+        pairs[unique++] = pairs[i];
+    }
+    count = unique;
+
+    int length = mOptions->whitelistBarcodeLength;
+    // about 4 barcodes for each bucket
+    int bucketBits = 8;
+    while(bucketBits < 2*length && bucketBits < 26 && (0x01UL << (bucketBits + 2)) < count)
+        bucketBits++;
+    if(bucketBits > 2*length)
+        bucketBits = 2*length;
+
+    uint64 namesLen = 0;
+    for(int s=0; s<mOptions->samples.size(); s++)
+        namesLen += sizeof(uint32) + mOptions->samples[s].file.length();
+
+    WhitelistHeader header;
+    memset(&header, 0, sizeof(WhitelistHeader));
+    memcpy(header.magic, WHITELIST_MAGIC, 8);
+    header.version = WHITELIST_VERSION;
+    header.barcodeLength = length;
+    header.signature = signature(mOptions);
+    header.count = count;
+    header.bucketBits = bucketBits;
+    header.sampleNum = mOptions->samples.size();
+    header.namesOffset = alignTo8(sizeof(WhitelistHeader));
+    header.bucketsOffset = alignTo8(header.namesOffset + namesLen);
+    header.keysOffset = alignTo8(header.bucketsOffset + ((0x01UL << bucketBits) + 1) * sizeof(uint32));
+    header.samplesOffset = alignTo8(header.keysOffset + count * sizeof(uint64));
+    header.fileLen = alignTo8(header.samplesOffset + count * sizeof(uint32));
+
+    mData = (char*)tmalloc(header.fileLen);
+    if(mData == NULL)
+        error_exit("Failed to allocate " + to_string(header.fileLen) + " bytes for the whitelist index");
+    memset(mData, 0, header.fileLen);
+    memcpy(mData, &header, sizeof(WhitelistHeader));
+
+    char* names = mData + header.namesOffset;
+    for(int s=0; s<mOptions->samples.size(); s++) {
+        uint32 len = mOptions->samples[s].file.length();
+        memcpy(names, &len, sizeof(uint32));
+        memcpy(names + sizeof(uint32), mOptions->samples[s].file.c_str(), len);
+        names += sizeof(uint32) + len;
+    }
+
+    setPointers(mData);
+    uint32* buckets = (uint32*)mBuckets;
+    uint64* sortedKeys = (uint64*)mKeys;
+    uint32* sortedSamples = (uint32*)mSamples;
+    uint64 bucketNum = 0x01UL << bucketBits;
+    uint64 b = 0;
+    for(uint64 i=0; i<count; i++) {
+        sortedKeys[i] = pairs[i].first;
+        sortedSamples[i] = pairs[i].second;
+        uint64 bucket = pairs[i].first >> mBucketShift;
+        while(b <= bucket)
+            buckets[b++] = i;
+    }
+    while(b <= bucketNum)
+        buckets[b++] = count;
+
+    mOptions->log("whitelist index built with " + to_string(count) + " barcodes and " + to_string(bucketNum) + " buckets");
+}
+
+void WhitelistIndex::setPointers(const char* data) {
+    mHeader = (const WhitelistHeader*)data;
+    mBuckets = (const uint32*)(data + mHeader->bucketsOffset);
+    mKeys = (const uint64*)(data + mHeader->keysOffset);
+    mSamples = (const uint32*)(data + mHeader->samplesOffset);
+    mBucketShift = 2 * mHeader->barcodeLength - mHeader->bucketBits;
+}
+
+bool WhitelistIndex::load(const string& filename) {
+    MappedFile* mapped = new MappedFile();
+    if(!mapped->open(filename) || mapped->size() < sizeof(WhitelistHeader)) {
+        delete mapped;
+        return false;
+    }
+    const WhitelistHeader* header = (const WhitelistHeader*)mapped->data();
+    if(memcmp(header->magic, WHITELIST_MAGIC, 8) != 0 || header->version != WHITELIST_VERSION
+        || header->signature != signature(mOptions) || header->fileLen != mapped->size()
+        || header->sampleNum != mOptions->samples.size() || !checkSections(header, mapped->data(), mapped->size())) {
+        delete mapped;
+        return false;
+    }
+    mMapped = mapped;
+    setPointers(mMapped->data());
+    return true;
+}
+
+// a section of len bytes at offset should be 8 bytes aligned and inside the file
+inline static bool inFile(uint64 offset, uint64 len, uint64 size) {
+    return offset % 8 == 0 && offset <= size && len <= size - offset;
+}
+
+bool WhitelistIndex::checkSections(const WhitelistHeader* header, const char* data, uint64 size) {
+    if(header->barcodeLength == 0 || header->barcodeLength > 32 || header->bucketBits > 2 * header->barcodeLength
+        || header->bucketBits > 26 || header->count > size / sizeof(uint64))
+        return false;
+    uint64 bucketNum = 0x01UL << header->bucketBits;
+    if(header->namesOffset < sizeof(WhitelistHeader) || !inFile(header->namesOffset, 0, size)
+        || !inFile(header->bucketsOffset, (bucketNum + 1) * sizeof(uint32), size)
+        || !inFile(header->keysOffset, header->count * sizeof(uint64), size)
+        || !inFile(header->samplesOffset, header->count * sizeof(uint32), size))
+        return false;
+
+    uint64 names = header->namesOffset;
+    for(uint32 s=0; s<header->sampleNum; s++) {
+        if(size - names < sizeof(uint32))
+            return false;
+        uint32 len = 0;
+        memcpy(&len, data + names, sizeof(uint32));
+        names += sizeof(uint32);
+        if(size - names < len)
+            return false;
+        names += len;
+    }
+    // the binary search of a bucket should stay in the keys, and the samples should be listed
+    const uint32* buckets = (const uint32*)(data + header->bucketsOffset);
+    for(uint64 b=0; b<bucketNum; b++) {
+        if(buckets[b] > buckets[b + 1])
+            return false;
+    }
+    if(buckets[0] != 0 || buckets[bucketNum] != header->count)
+        return false;
+    const uint32* samples = (const uint32*)(data + header->samplesOffset);
+    for(uint64 i=0; i<header->count; i++) {
+        if(samples[i] >= header->sampleNum)
+            return false;
+    }
+    return true;
+}
+
+bool WhitelistIndex::loadSamples(const string& filename, uint64 signature, vector<Sample>& samples, int& barcodeLength) {
+    // the index is checked as load() does, so that the sheet is parsed again if the index will be rebuilt
+    MappedFile file;
+    if(!file.open(filename) || file.size() < sizeof(WhitelistHeader))
+        return false;
+    const char* data = file.data();
+    const WhitelistHeader* header = (const WhitelistHeader*)data;
+    if(memcmp(header->magic, WHITELIST_MAGIC, 8) != 0 || header->version != WHITELIST_VERSION
+        || header->signature != signature || header->fileLen != file.size() || !checkSections(header, data, file.size()))
+        return false;
+    vector<Sample> loaded;
+    const char* names = data + header->namesOffset;
+    for(uint32 s=0; s<header->sampleNum; s++) {
+        uint32 len = 0;
+        memcpy(&len, names, sizeof(uint32));
+        Sample sample;
+        sample.file = string(names + sizeof(uint32), len);
+        loaded.push_back(sample);
+        names += sizeof(uint32) + len;
+    }
+    samples.swap(loaded);
+    barcodeLength = header->barcodeLength;
+    return true;
+}
+
+long WhitelistIndex::find(uint64 key) {
+    uint64 bucket = key >> mBucketShift;
+    const uint64* begin = mKeys + mBuckets[bucket];
+    const uint64* end = mKeys + mBuckets[bucket + 1];
+    const uint64* pos = lower_bound(begin, end, key);
+    if(pos == end || *pos != key)
+        return -1;
+    return pos - mKeys;
+}
+
+int WhitelistIndex::match(const char* data, size_t len, int& dist) {
+    if(len != mHeader->barcodeLength)
+        return -1;
+
+    uint64 key = 0;
+    int nPos = -1;
+    for(int k=0; k<len; k++) {
+        uint64 val = 0;
+        switch(data[k]){
+            case 'A': val = 0; break;
+            case 'T': val = 1; break;
+            case 'C': val = 2; break;
+            case 'G': val = 3; break;
+            default:
+                // only one N can be corrected
+                if(nPos >= 0 || mOptions->mismatch == 0)
+                    return -1;
+                nPos = len - 1 - k;
+        }
+        key = (key<<2) | val;
+    }
+
+    if(nPos < 0) {
+        long pos = find(key);
+        if(pos >= 0) {
+            dist = 0;
+            return mSamples[pos];
+        }
+        if(mOptions->mismatch == 0)
+            return -1;
+    }
+
+    // 1 mismatch correction, all the neighbours found should belong to a same sample
+    int sample = -1;
+    for(int p=0; p<len; p++) {
+        if(nPos >= 0 && p != nPos)
+            continue;
+        // the N was encoded as A, so A is also a candidate at its position
+        uint64 firstDelta = nPos >= 0 ? 0 : 1;
+        for(uint64 delta=firstDelta; delta<=3; delta++) {
+            uint64 mutant = key ^ (delta << (p<<1));
+            long pos = find(mutant);
+            if(pos < 0)
+                continue;
+            if(sample >= 0 && sample != mSamples[pos])
+                return -1;
+            sample = mSamples[pos];
+        }
+    }
+    if(sample >= 0)
+        dist = 1;
+    return sample;
+}
+
+bool WhitelistIndex::test() {
+    Options opt;
+    opt.mismatch = 1;
+    opt.whitelistBarcodeLength = 8;
+    const char* names[3] = {"well1", "well2", "well3"};
+    for(int s=0; s<3; s++) {
+        Sample sample;
+        sample.file = names[s];
+        opt.samples.push_back(sample);
+    }
+    const char* barcodes[5] = {"AGTCAGAA", "CCGTTACG", "AGTCAGTT", "TTTTAAAA", "GGGGCCCC"};
+    const uint32 samples[5] = {0, 1, 2, 0, 1};
+    for(int i=0; i<5; i++) {
+        uint64 key = 0;
+        encode(barcodes[i], 8, key);
+        opt.whitelistKeys.push_back(key);
+        opt.whitelistSamples.push_back(samples[i]);
+    }
+
+    WhitelistIndex index(&opt);
+    int dist = -1;
+    if(index.match("TTTTAAAA", 8, dist) != 0 || dist != 0)
+        return false;
+    if(index.match("GGGGCCCC", 8, dist) != 1 || dist != 0)
+        return false;
+    if(index.match("GGGGCACC", 8, dist) != 1 || dist != 1)
+        return false;
+    if(index.match("GGGGCNCC", 8, dist) != 1 || dist != 1)
+        return false;
+    if(index.match("GGGNCNCC", 8, dist) != -1)
+        return false;
+    if(index.match("GGGGAACC", 8, dist) != -1)
+        return false;
+    // AGTCAGAT is 1 mismatch to AGTCAGAA (well1) and AGTCAGTT (well3)
+    if(index.match("AGTCAGAT", 8, dist) != -1)
+        return false;
+
+    // a saved index is reloaded with its sample names and barcode length, without the parsed barcodes
+    string filename = "/tmp/defastq_test_" + to_string(getpid()) + ".wl";
+    Options saveOpt;
+    saveOpt.mismatch = 1;
+    saveOpt.whitelistBarcodeLength = 8;
+    saveOpt.samples = opt.samples;
+    for(int i=0; i<5; i++) {
+        uint64 key = 0;
+        encode(barcodes[i], 8, key);
+        saveOpt.whitelistKeys.push_back(key);
+        saveOpt.whitelistSamples.push_back(samples[i]);
+    }
+    saveOpt.prebuiltIndexFile = filename;
+    WhitelistIndex* saved = new WhitelistIndex(&saveOpt);
+    delete saved;
+    Options loadOpt;
+    loadOpt.mismatch = 1;
+    loadOpt.prebuiltIndexFile = filename;
+    bool loaded = loadSamples(filename, signature(&loadOpt), loadOpt.samples, loadOpt.whitelistBarcodeLength);
+    if(!loaded || loadOpt.samples.size() != 3 || loadOpt.samples[2].file != "well3" || loadOpt.whitelistBarcodeLength != 8) {
+        remove(filename.c_str());
+        return false;
+    }
+    WhitelistIndex reloaded(&loadOpt);
+    if(reloaded.barcodeLength() != 8)
+        return false;
+    if(reloaded.match("GGGGCACC", 8, dist) != 1 || dist != 1)
+        return false;
+    if(reloaded.match("AGTCAGTT", 8, dist) != 2 || dist != 0)
+        return false;
+
+    // a corrupted section is refused, so that the index is rebuilt
+    string content((const char*)reloaded.mHeader, reloaded.mHeader->fileLen);
+    remove(filename.c_str());
+    WhitelistHeader* header = (WhitelistHeader*)&content[0];
+    header->keysOffset = header->fileLen;
+    MappedFile::writeAtomically(filename, content.c_str(), content.length());
+    bool corruptLoaded = reloaded.load(filename);
+    remove(filename.c_str());
+    return !corruptLoaded;
+}
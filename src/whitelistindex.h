@@ -0,0 +1,97 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef WHITELIST_INDEX_H
+#define WHITELIST_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "options.h"
+#include "mappedfile.h"
+
+using namespace std;
+
+const char WHITELIST_MAGIC[8] = {'D', 'F', 'Q', 'W', 'L', 'I', 'D', 'X'};
+const uint32 WHITELIST_VERSION = 1;
+
+// the index file begins with this header, all the offsets are in bytes from the file beginning
+struct WhitelistHeader {
+    char magic[8];
+    uint32 version;
+    uint32 barcodeLength;
+    uint64 signature;
+    uint64 count;
+    uint32 bucketBits;
+    uint32 sampleNum;
+    uint64 namesOffset;
+    uint64 bucketsOffset;
+    uint64 keysOffset;
+    uint64 samplesOffset;
+    uint64 fileLen;
+};
+
+// A whitelist of 10^5 ~ 10^7 barcodes (<= 32bp) with 0 or 1 mismatch correction, many barcodes can go to a same sample.
+// The barcodes are 2-bit encoded and sorted, the leading bits of a key select a bucket to narrow the binary search.
+// All the data lives in one contiguous block with the layout of the index file, so that a saved index can be
+// memory mapped read-only, and the page cache is shared by all defastq processes using it.
+class WhitelistIndex{
+public:
+    WhitelistIndex(Options* opt);
+    ~WhitelistIndex();
+    // return the sample or -1, the distance is stored in dist
+    int match(const char* data, size_t len, int& dist);
+    int barcodeLength() {return mHeader->barcodeLength;}
+
+    // encode a barcode without N, false if it contains N or is longer than 32bp
+    static bool encode(const char* data, size_t len, uint64& key);
+    // a signature of the whitelist source (sheet size, modification time and options)
+    static uint64 signature(Options* opt);
+    // read the sample names and the barcode length from a prebuilt index, false if it is missing or out of date
+    static bool loadSamples(const string& filename, uint64 signature, vector<Sample>& samples, int& barcodeLength);
+    static bool test();
+
+private:
+    void build();
+    bool load(const string& filename);
+    // all the sections of a mapped index should be inside the file, false if it is truncated or corrupted
+    static bool checkSections(const WhitelistHeader* header, const char* data, uint64 size);
+    void setPointers(const char* data);
+    inline long find(uint64 key);
+
+private:
+    Options* mOptions;
+    // the index built in memory, or the mapped index file
+    char* mData;
+    MappedFile* mMapped;
+    const WhitelistHeader* mHeader;
+    const uint32* mBuckets;
+    const uint64* mKeys;
+    const uint32* mSamples;
+    int mBucketShift;
+};
+
+#endif
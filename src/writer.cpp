@@ -27,6 +27,7 @@ SOFTWARE.
 #include "fastqreader.h"
 #include <string.h>
 #include "memfunc.h"
+#include <algorithm>
 
 Writer::Writer(Options* opt, string filename, int compression, bool isRead2, bool isUndetermined){
 	mCompression = compression;
@@ -40,6 +41,12 @@ Writer::Writer(Options* opt, string filename, int compression, bool isRead2, boo
 	mBufSize = mOptions->writerBufferSize;
 	mIsUndetermined = isUndetermined;
 	mIsRead2 = isRead2;
+	for(int i=0; i<mOptions->umiSegments.size(); i++) {
+		UmiSegment& seg = mOptions->umiSegments[i];
+		if(seg.read2 == mIsRead2)
+			mUmiCuts.push_back(make_pair(seg.start, seg.length));
+	}
+	selectWriteKernel();
 	init();
 }
 
@@ -86,42 +93,96 @@ void Writer::init(){
 	}
 }
 
+void Writer::selectWriteKernel() {
+	// the reads of this file can have an inline barcode only if the barcode is in this mate
+	int inlinePlace = mOptions->inlineBarcodePlace();
+	bool mayHaveBarcode = (inlinePlace == BARCODE_AT_READ1 && !mIsRead2) || (inlinePlace == BARCODE_AT_READ2 && mIsRead2);
+	if(mIsUndetermined || (!mayHaveBarcode && mOptions->umiSegments.empty()))
+		mWriteKernel = &Writer::writeRawRead;
+	else
+		mWriteKernel = &Writer::writeEditedRead;
+}
+
 bool Writer::writeRead(SimpleRead* r) {
-	char* d = r->data();
-	if(r->dataLen() + mBufDataLen > mBufSize)
+	// the read name can be longer with the UMI
+	size_t outLen = r->dataLen() + r->umiLen() + 1;
+	if(outLen + mBufDataLen > mBufSize)
 		flush();
-	if(r->dataLen() > mBufSize)
-		write(d, r->dataLen());
-	else {
-		if((mOptions->barcodePlace == BARCODE_AT_READ1 && !mIsRead2) || (mOptions->barcodePlace == BARCODE_AT_READ2 && mIsRead2)) {
-			// remove the barcode from read
-			int cutLen = min(mOptions->barcodeLength, (int)r->seqLen() - mOptions->barcodeStart);
-			if(cutLen <= 0 || mIsUndetermined) {
-				memcpy(mBuffer + mBufDataLen, d, r->dataLen());
-				mBufDataLen += r->dataLen();
-			} else {
-				// first part
-				memcpy(mBuffer + mBufDataLen, d, r->seqStart() + mOptions->barcodeStart);
-				mBufDataLen += r->seqStart() + mOptions->barcodeStart;
-				// second part
-				int secondPartStart = r->seqStart() + mOptions->barcodeStart + cutLen;
-				int secondPartLen =  r->qualStart() + mOptions->barcodeStart - secondPartStart;
-				memcpy(mBuffer + mBufDataLen, d + secondPartStart, secondPartLen);
-				mBufDataLen += secondPartLen;
-				// second part
-				int thirdPartStart = r->qualStart() + mOptions->barcodeStart + cutLen;
-				int thirdPartLen =  r->dataLen() - thirdPartStart;
-				if(thirdPartLen > 0) {
-					memcpy(mBuffer + mBufDataLen, d + thirdPartStart, thirdPartLen);
-					mBufDataLen += thirdPartLen;
-				}
-			}
-		} else {
-			memcpy(mBuffer + mBufDataLen, d, r->dataLen());
-			mBufDataLen += r->dataLen();
+	if(outLen > mBufSize)
+		write(r->data(), r->dataLen());
+	else
+		(this->*mWriteKernel)(r);
+	return true;
+}
+
+void Writer::writeRawRead(SimpleRead* r) {
+	memcpy(mBuffer + mBufDataLen, r->data(), r->dataLen());
+	mBufDataLen += r->dataLen();
+}
+
+void Writer::writeEditedRead(SimpleRead* r) {
+	if(r->barcodeLen() == 0 && r->umiLen() == 0 && mUmiCuts.empty()) {
+		writeRawRead(r);
+		return;
+	}
+	char* d = r->data();
+	int seqLen = r->seqLen();
+
+	// the spans of the sequence to remove: the matched inline barcode and the UMI segments of this read
+	pair<int, int> cuts[UMI_MAX_LEN + 1];
+	int cutNum = 0;
+	for(int i=0; i<mUmiCuts.size(); i++)
+		cuts[cutNum++] = mUmiCuts[i];
+	if(r->barcodeLen() > 0)
+		cuts[cutNum++] = make_pair((int)r->barcodeStart(), (int)r->barcodeLen());
+	sort(cuts, cuts + cutNum);
+
+	// the read name, the UMI is appended to the first word
+	int nameWordLen = 0;
+	while(nameWordLen < r->nameLen() && d[nameWordLen] != ' ' && d[nameWordLen] != '\t')
+		nameWordLen++;
+	memcpy(mBuffer + mBufDataLen, d, nameWordLen);
+	mBufDataLen += nameWordLen;
+	if(r->umiLen() > 0) {
+		mBuffer[mBufDataLen++] = ':';
+		memcpy(mBuffer + mBufDataLen, r->umi(), r->umiLen());
+		mBufDataLen += r->umiLen();
+	}
+	memcpy(mBuffer + mBufDataLen, d + nameWordLen, r->seqStart() - nameWordLen);
+	mBufDataLen += r->seqStart() - nameWordLen;
+
+	// sequence
+	copyWithCuts(d + r->seqStart(), seqLen, cuts, cutNum);
+	// the strand line
+	int seqEnd = r->seqStart() + seqLen;
+	memcpy(mBuffer + mBufDataLen, d + seqEnd, r->qualStart() - seqEnd);
+	mBufDataLen += r->qualStart() - seqEnd;
+	// quality
+	int qualLen = min((int)r->qualLen(), (int)r->dataLen() - (int)r->qualStart());
+	copyWithCuts(d + r->qualStart(), qualLen, cuts, cutNum);
+	int qualEnd = r->qualStart() + qualLen;
+	if(qualEnd < r->dataLen()) {
+		memcpy(mBuffer + mBufDataLen, d + qualEnd, r->dataLen() - qualEnd);
+		mBufDataLen += r->dataLen() - qualEnd;
+	}
+}
+
+void Writer::copyWithCuts(const char* data, int len, const pair<int, int>* cuts, int cutNum) {
+	int pos = 0;
+	for(int c=0; c<cutNum; c++) {
+		int cutStart = min(cuts[c].first, len);
+		int cutEnd = min(cuts[c].first + cuts[c].second, len);
+		if(cutStart > pos) {
+			memcpy(mBuffer + mBufDataLen, data + pos, cutStart - pos);
+			mBufDataLen += cutStart - pos;
 		}
+		// the cuts may overlap
+		pos = max(pos, cutEnd);
+	}
+	if(len > pos) {
+		memcpy(mBuffer + mBufDataLen, data + pos, len - pos);
+		mBufDataLen += len - pos;
 	}
-	return true;
 }
 
 bool Writer::write(char* strdata, size_t size) {
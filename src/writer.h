@@ -31,6 +31,7 @@ SOFTWARE.
 #include "simpleread.h"
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include "libdeflate.h"
 #include "options.h"
 #include <stdio.h>
@@ -53,6 +54,12 @@ public:
 private:
 	void init();
 	void close();
+	// select the write kernel once, so that the reads of a file are written without checking the options
+	void selectWriteKernel();
+	void writeRawRead(SimpleRead* r);
+	// remove the barcode and UMI bases, and add the UMI to the read name
+	void writeEditedRead(SimpleRead* r);
+	void copyWithCuts(const char* data, int len, const pair<int, int>* cuts, int cutNum);
 
 private:
 	string mFilename;
@@ -68,6 +75,9 @@ private:
 	Options* mOptions;
 	bool mIsRead2;
 	bool mIsUndetermined;
+	// the UMI segments (start, length) of this read
+	vector<pair<int, int> > mUmiCuts;
+	void (Writer::*mWriteKernel)(SimpleRead*);
 };
 
 #endif
\ No newline at end of file
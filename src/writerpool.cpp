@@ -0,0 +1,152 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "writerpool.h"
+#include "util.h"
+#include <functional>
+
+WriterPool::WriterPool(Options* opt, int threadNum){
+    mOptions = opt;
+    mThreadNum = max(1, threadNum);
+    mQueues.resize(mThreadNum);
+    mQueueLocks = new mutex[mThreadNum];
+    mPendingTasks = 0;
+    mFinished = false;
+    mTasks.resize(mThreadNum, 0);
+    mStolen.resize(mThreadNum, 0);
+    mSleepTime.resize(mThreadNum, 0);
+}
+
+WriterPool::~WriterPool() {
+    for(int i=0; i<mOutputs.size(); i++) {
+        delete mOutputs[i]->writer;
+        delete mOutputs[i];
+    }
+    mOutputs.clear();
+    delete[] mQueueLocks;
+}
+
+int WriterPool::addOutput(string filename, MultiProducerSingleConsumerList<SimpleRead*>* list, bool isRead2, bool isUndetermined) {
+    string fullpath = joinpath(mOptions->outFolder, filename)+".fastq";
+    if(mOptions->compression > 0)
+        fullpath += ".gz";
+    WriterOutput* out = new WriterOutput();
+    out->list = list;
+    out->writer = new Writer(mOptions, fullpath, mOptions->compression, isRead2, isUndetermined);
+    out->scheduled = false;
+    mOutputs.push_back(out);
+    return mOutputs.size() - 1;
+}
+
+void WriterPool::start() {
+    for(int t=0; t<mThreadNum; t++)
+        mThreads.push_back(new std::thread(std::bind(&WriterPool::workerTask, this, t)));
+}
+
+void WriterPool::finish() {
+    mFinished = true;
+    // the lists may have reads that no notify() has scheduled
+    for(int i=0; i<mOutputs.size(); i++) {
+        if(!mOutputs[i]->scheduled.load())
+            schedule(i, i % mThreadNum);
+    }
+    mSignal.notify();
+    for(int t=0; t<mThreads.size(); t++) {
+        mThreads[t]->join();
+        delete mThreads[t];
+        mOptions->log("writer thread " + to_string(t) + " exited with " + to_string(mTasks[t]) + " tasks (" + to_string(mStolen[t]) + " stolen) and sleep time: " + to_string(mSleepTime[t]));
+    }
+    mThreads.clear();
+    for(int i=0; i<mOutputs.size(); i++)
+        mOutputs[i]->list->setConsumerFinished();
+}
+
+void WriterPool::schedule(int output, int thread) {
+    bool expected = false;
+    if(!mOutputs[output]->scheduled.compare_exchange_strong(expected, true))
+        return;
+    {
+        lock_guard<mutex> guard(mQueueLocks[thread]);
+        mQueues[thread].push_back(output);
+    }
+    mPendingTasks++;
+    // a task is taken by one thread, so waking all the parked threads would only park the others again
+    mSignal.notifyOne();
+}
+
+int WriterPool::takeTask(int thread) {
+    if(mPendingTasks.load() == 0)
+        return -1;
+    // the own queue first, in FIFO order
+    {
+        lock_guard<mutex> guard(mQueueLocks[thread]);
+        if(!mQueues[thread].empty()) {
+            int output = mQueues[thread].front();
+            mQueues[thread].pop_front();
+            mPendingTasks--;
+            return output;
+        }
+    }
+    // steal from the back of the other queues
+    for(int i=1; i<mThreadNum; i++) {
+        int victim = (thread + i) % mThreadNum;
+        lock_guard<mutex> guard(mQueueLocks[victim]);
+        if(!mQueues[victim].empty()) {
+            int output = mQueues[victim].back();
+            mQueues[victim].pop_back();
+            mPendingTasks--;
+            mStolen[thread]++;
+            return output;
+        }
+    }
+    return -1;
+}
+
+void WriterPool::writeOutput(int output, int thread) {
+    WriterOutput* out = mOutputs[output];
+    for(int i=0; i<WRITER_TASK_READS && out->list->canBeConsumed(); i++) {
+        SimpleRead* r = out->list->consume();
+        out->writer->writeRead(r);
+        delete r;
+    }
+    out->scheduled = false;
+    // a read produced before the flag is cleared may not have scheduled a task
+    atomic_thread_fence(memory_order_seq_cst);
+    if(out->list->canBeConsumed())
+        schedule(output, thread);
+}
+
+void WriterPool::workerTask(int thread) {
+    while(true) {
+        int output = takeTask(thread);
+        if(output >= 0) {
+            writeOutput(output, thread);
+            mTasks[thread]++;
+            continue;
+        }
+        if(mFinished && mPendingTasks.load() == 0)
+            break;
+        mSleepTime[thread] += mSignal.waitUntil([this](){return mPendingTasks.load() > 0 || mFinished;});
+    }
+}
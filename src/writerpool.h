@@ -0,0 +1,100 @@
+/*
+MIT License
+
+Copyright (c) 2021 Shifu Chen <chen@haplox.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef WRITER_POOL_H
+#define WRITER_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "writer.h"
+#include "options.h"
+#include "simpleread.h"
+#include "multiproducersingleconsumerlist.h"
+#include "waitsignal.h"
+
+using namespace std;
+
+// the reads written by a task before the output is put back, so that the other outputs get their turns
+const int WRITER_TASK_READS = 4096;
+
+// an output file and the list of its reads
+struct WriterOutput {
+    MultiProducerSingleConsumerList<SimpleRead*>* list;
+    Writer* writer;
+    // the output is in a task queue or being written, so only one thread consumes its list
+    atomic_bool scheduled;
+};
+
+// A fixed number of writer threads shared by all the outputs.
+// Writing the pending reads of an output is a task, which is queued to the home thread of the output when its list gets reads,
+// and an idle thread steals the tasks of the other threads, so the skewed samples do not leave the other threads idle.
+class WriterPool{
+public:
+    WriterPool(Options* opt, int threadNum);
+    ~WriterPool();
+
+    // returns the output id
+    int addOutput(string filename, MultiProducerSingleConsumerList<SimpleRead*>* list, bool isRead2, bool isUndetermined);
+    void start();
+    // called by a producer after it produces a read to the list of an output
+    inline void notify(int output) {
+        // pairs with the task clearing the flag before checking its list again
+        atomic_thread_fence(memory_order_seq_cst);
+        if(mOutputs[output]->scheduled.load(memory_order_relaxed))
+            return;
+        schedule(output, output % mThreadNum);
+    }
+    // called after all the producers are finished, returns when all the reads are written
+    void finish();
+
+private:
+    void schedule(int output, int thread);
+    // take a task from the queue of this thread, or steal one from the others, -1 if there is none
+    int takeTask(int thread);
+    void writeOutput(int output, int thread);
+    void workerTask(int thread);
+
+private:
+    Options* mOptions;
+    int mThreadNum;
+    vector<WriterOutput*> mOutputs;
+    vector<deque<int> > mQueues;
+    mutex* mQueueLocks;
+    atomic_long mPendingTasks;
+    atomic_bool mFinished;
+    WaitSignal mSignal;
+    vector<thread*> mThreads;
+    // the tasks run, stolen and the parking times of each thread
+    vector<long> mTasks;
+    vector<long> mStolen;
+    vector<long> mSleepTime;
+};
+
+#endif